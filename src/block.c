@@ -22,6 +22,7 @@
 #include "hw/virtio-scsi.h" // virtio_scsi_process_op
 #include "hw/nvme.h" // nvme_process_op
 #include "malloc.h" // malloc_low
+#include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
 #include "stacks.h" // call32
 #include "std/disk.h" // struct dpte_s
@@ -191,6 +192,220 @@ setup_translation(struct drive_s *drive)
 }
 
 
+/****************************************************************
+ * Disk read cache
+ ****************************************************************/
+
+// Reads larger than this are not inserted into the cache - they are
+// usually bulk loads that would only evict more useful sectors.
+#define BLOCK_CACHE_MAX_FILL 8
+
+struct block_cache_entry_s {
+    struct drive_s *drive_fl;
+    u64 lba;
+    u32 lastuse;
+};
+
+struct block_cache_drive_s {
+    struct drive_s *drive_fl;
+    u32 hits, misses;
+};
+
+struct block_cache_s {
+    u32 clock;
+    int entrycount;
+    struct block_cache_entry_s *entries;
+    u8 *data;
+    struct block_cache_drive_s drives[BUILD_MAX_EXTDRIVE];
+};
+
+// Cache state is allocated in ZoneHigh so it stays writable after boot.
+// The pointer itself is only set during POST.
+struct block_cache_s *BlockCache VARFSEG;
+
+static struct block_cache_s *
+block_cache_alloc(void)
+{
+    int count = CONFIG_BLOCK_CACHE_SIZE * 1024 / DISK_SECTOR_SIZE;
+    if (count <= 0)
+        return NULL;
+    struct block_cache_s *bc = malloc_high(sizeof(*bc));
+    struct block_cache_entry_s *entries = malloc_high(sizeof(*entries) * count);
+    u8 *data = malloc_high(count * DISK_SECTOR_SIZE);
+    if (!bc || !entries || !data) {
+        warn_noalloc();
+        free(bc);
+        free(entries);
+        free(data);
+        return NULL;
+    }
+    memset(bc, 0, sizeof(*bc));
+    memset(entries, 0, sizeof(*entries) * count);
+    bc->entrycount = count;
+    bc->entries = entries;
+    bc->data = data;
+    dprintf(3, "disk read cache: %d sectors at %p\n", count, data);
+    return bc;
+}
+
+// Enable caching of reads from a hard drive
+static void
+block_cache_add_drive(struct drive_s *drive)
+{
+    if (!CONFIG_BLOCK_CACHE || drive->blksize != DISK_SECTOR_SIZE)
+        return;
+    if (!BlockCache) {
+        BlockCache = block_cache_alloc();
+        if (!BlockCache)
+            return;
+    }
+    struct block_cache_s *bc = BlockCache;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(bc->drives); i++) {
+        if (!bc->drives[i].drive_fl) {
+            bc->drives[i].drive_fl = drive;
+            return;
+        }
+    }
+}
+
+static struct block_cache_drive_s *
+block_cache_find_drive(struct block_cache_s *bc, struct drive_s *drive_fl)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(bc->drives); i++)
+        if (bc->drives[i].drive_fl == drive_fl)
+            return &bc->drives[i];
+    return NULL;
+}
+
+static struct block_cache_entry_s *
+block_cache_find(struct block_cache_s *bc, struct drive_s *drive_fl, u64 lba)
+{
+    int i;
+    for (i = 0; i < bc->entrycount; i++) {
+        struct block_cache_entry_s *e = &bc->entries[i];
+        if (e->drive_fl == drive_fl && e->lba == lba)
+            return e;
+    }
+    return NULL;
+}
+
+static void *
+block_cache_data(struct block_cache_s *bc, struct block_cache_entry_s *e)
+{
+    return bc->data + (e - bc->entries) * DISK_SECTOR_SIZE;
+}
+
+// Complete a read from the cache.  Returns 0 only if every requested
+// sector was present.
+static int
+block_cache_read(struct block_cache_s *bc, struct disk_op_s *op)
+{
+    if (!op->count || op->count > bc->entrycount)
+        return -1;
+    int i;
+    for (i = 0; i < op->count; i++)
+        if (!block_cache_find(bc, op->drive_fl, op->lba + i))
+            return -1;
+    for (i = 0; i < op->count; i++) {
+        struct block_cache_entry_s *e = block_cache_find(
+            bc, op->drive_fl, op->lba + i);
+        memcpy(op->buf_fl + i * DISK_SECTOR_SIZE, block_cache_data(bc, e)
+               , DISK_SECTOR_SIZE);
+        e->lastuse = ++bc->clock;
+    }
+    return 0;
+}
+
+// Insert the sectors of a completed read, evicting the least
+// recently used entries.
+static void
+block_cache_fill(struct block_cache_s *bc, struct disk_op_s *op)
+{
+    if (op->count > BLOCK_CACHE_MAX_FILL)
+        return;
+    int i;
+    for (i = 0; i < op->count; i++) {
+        struct block_cache_entry_s *e = block_cache_find(
+            bc, op->drive_fl, op->lba + i);
+        if (!e) {
+            e = &bc->entries[0];
+            int j;
+            for (j = 1; j < bc->entrycount; j++)
+                if (bc->entries[j].lastuse < e->lastuse)
+                    e = &bc->entries[j];
+            e->drive_fl = op->drive_fl;
+            e->lba = op->lba + i;
+        }
+        memcpy(block_cache_data(bc, e), op->buf_fl + i * DISK_SECTOR_SIZE
+               , DISK_SECTOR_SIZE);
+        e->lastuse = ++bc->clock;
+    }
+}
+
+// Drop any cached sectors of a drive in the range [lba, lba+count)
+static void
+block_cache_invalidate(struct block_cache_s *bc, struct drive_s *drive_fl
+                       , u64 lba, u64 count)
+{
+    int i;
+    for (i = 0; i < bc->entrycount; i++) {
+        struct block_cache_entry_s *e = &bc->entries[i];
+        if (e->drive_fl == drive_fl && e->lba >= lba && e->lba - lba < count) {
+            e->drive_fl = NULL;
+            e->lastuse = 0;
+        }
+    }
+}
+
+
+/****************************************************************
+ * Sequential read-ahead
+ ****************************************************************/
+
+struct block_readahead_s {
+    struct drive_s *drive_fl;
+    u64 nextlba;        // Sector following the last read of drive_fl
+    u64 lba;            // First sector held in buf
+    u32 count;          // Sectors held in buf (0 if empty)
+    u32 window;         // Sectors to read ahead
+    u8 *buf;
+};
+
+// Staging buffer state is allocated in ZoneHigh so it stays writable.
+struct block_readahead_s *ReadAhead VARFSEG;
+
+// Allocate the staging buffer once a suitable hard drive is found
+static void
+block_readahead_add_drive(struct drive_s *drive)
+{
+    if (!CONFIG_BLOCK_READAHEAD || drive->blksize != DISK_SECTOR_SIZE
+        || ReadAhead)
+        return;
+    u32 size = CONFIG_BLOCK_READAHEAD_SIZE * 1024;
+    // The window is read by process_op_driver_32(), which is not
+    // bound by the 64KB limit of the 16bit disk interface.
+    if (size > 1024*1024)
+        size = 1024*1024;
+    if (size < 2 * DISK_SECTOR_SIZE)
+        return;
+    struct block_readahead_s *ra = malloc_high(sizeof(*ra));
+    u8 *buf = memalign_high(PAGE_SIZE, size);
+    if (!ra || !buf) {
+        warn_noalloc();
+        free(ra);
+        free(buf);
+        return;
+    }
+    memset(ra, 0, sizeof(*ra));
+    ra->window = size / DISK_SECTOR_SIZE;
+    ra->buf = buf;
+    ReadAhead = ra;
+    dprintf(3, "disk read-ahead: %d sectors at %p\n", ra->window, buf);
+}
+
+
 /****************************************************************
  * Drive mapping
  ****************************************************************/
@@ -261,6 +476,8 @@ map_hd_drive(struct drive_s *drive)
     int hdid = bda->hdcount;
     dprintf(3, "Mapping hd drive %p to %d\n", drive, hdid);
     add_drive(IDMap[EXTTYPE_HD], &bda->hdcount, drive);
+    block_cache_add_drive(drive);
+    block_readahead_add_drive(drive);
 
     // Setup disk geometry translation.
     setup_translation(drive);
@@ -568,10 +785,9 @@ process_op_both(struct disk_op_s *op)
 }
 
 // Command dispatch for disk drivers that only run in 32bit mode
-int VISIBLE32FLAT
-process_op_32(struct disk_op_s *op)
+static int
+process_op_driver_32(struct disk_op_s *op)
 {
-    ASSERT32FLAT();
     switch (op->drive_fl->type) {
     case DTYPE_VIRTIO_BLK:
         return virtio_blk_process_op(op);
@@ -596,6 +812,123 @@ process_op_32(struct disk_op_s *op)
     }
 }
 
+// Serve sequential reads from the read-ahead buffer, refilling it
+// with a full window whenever a read continues where the previous
+// one ended.  Any other access discards the buffer.
+static int
+block_readahead_process_op(struct disk_op_s *op)
+{
+    struct block_readahead_s *ra = ReadAhead;
+    struct drive_s *drive_fl = op->drive_fl;
+    if (!CONFIG_BLOCK_READAHEAD || !ra || drive_fl->blksize != DISK_SECTOR_SIZE)
+        return process_op_driver_32(op);
+
+    switch (op->command) {
+    case CMD_READ:
+        break;
+    case CMD_WRITE:
+    case CMD_FORMAT:
+    case CMD_SCSI:
+        if (ra->drive_fl == drive_fl)
+            ra->drive_fl = NULL;
+        // Fall through
+    default:
+        return process_op_driver_32(op);
+    }
+    u64 lba = op->lba;
+    u16 count = op->count;
+    if (!count)
+        return process_op_driver_32(op);
+
+    if (ra->drive_fl == drive_fl && lba >= ra->lba
+        && lba + count <= ra->lba + ra->count) {
+        memcpy(op->buf_fl, ra->buf + (lba - ra->lba) * DISK_SECTOR_SIZE
+               , count * DISK_SECTOR_SIZE);
+        ra->nextlba = lba + count;
+        return DISK_RET_SUCCESS;
+    }
+
+    int sequential = ra->drive_fl == drive_fl && lba == ra->nextlba;
+    ra->drive_fl = drive_fl;
+    ra->nextlba = lba + count;
+    ra->count = 0;
+    u32 racount = ra->window;
+    if (drive_fl->max_sectors && racount > drive_fl->max_sectors)
+        racount = drive_fl->max_sectors;
+    if (lba + racount > drive_fl->sectors)
+        racount = lba < drive_fl->sectors ? drive_fl->sectors - lba : 0;
+    if (!sequential || racount <= count)
+        return process_op_driver_32(op);
+
+    struct disk_op_s raop = *op;
+    raop.buf_fl = ra->buf;
+    raop.count = racount;
+    int ret = process_op_driver_32(&raop);
+    if (ret)
+        // Retry just the requested sectors
+        return process_op_driver_32(op);
+    dprintf(DEBUG_HDL_13, "disk read-ahead d=%p lba=%d count=%d\n"
+            , drive_fl, (u32)lba, racount);
+    ra->lba = lba;
+    ra->count = racount;
+    memcpy(op->buf_fl, ra->buf, count * DISK_SECTOR_SIZE);
+    return DISK_RET_SUCCESS;
+}
+
+// Pass a request through the disk read cache.  Writes are sent to the
+// drive and then invalidate any cached copy of the written sectors.
+static int
+block_cache_process_op(struct block_cache_s *bc, struct disk_op_s *op)
+{
+    struct block_cache_drive_s *bcd = block_cache_find_drive(bc, op->drive_fl);
+    if (!bcd)
+        return block_readahead_process_op(op);
+
+    int ret;
+    switch (op->command) {
+    case CMD_READ:
+        if (!block_cache_read(bc, op)) {
+            bcd->hits++;
+            return DISK_RET_SUCCESS;
+        }
+        bcd->misses++;
+        dprintf(DEBUG_HDL_13, "disk cache miss d=%p lba=%d count=%d"
+                " (hits=%u misses=%u)\n", op->drive_fl, (u32)op->lba
+                , op->count, bcd->hits, bcd->misses);
+        ret = block_readahead_process_op(op);
+        if (!ret)
+            block_cache_fill(bc, op);
+        return ret;
+    case CMD_WRITE:
+    case CMD_FORMAT: {
+        // The driver may reduce op->count on a partial transfer.
+        u64 lba = op->lba;
+        u16 count = op->count;
+        ret = block_readahead_process_op(op);
+        block_cache_invalidate(bc, op->drive_fl, lba, count);
+        return ret;
+    }
+    case CMD_SCSI:
+        // Pass-through commands may modify any part of the drive.
+        ret = block_readahead_process_op(op);
+        block_cache_invalidate(bc, op->drive_fl, 0, -1);
+        return ret;
+    default:
+        return block_readahead_process_op(op);
+    }
+}
+
+// Entry point for requests handled in 32bit mode
+int VISIBLE32FLAT
+process_op_32(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    struct block_cache_s *bc = BlockCache;
+    if (CONFIG_BLOCK_CACHE && bc)
+        return block_cache_process_op(bc, op);
+    return block_readahead_process_op(op);
+}
+
 // Command dispatch for disk drivers that only run in 16bit mode
 static int
 process_op_16(struct disk_op_s *op)
@@ -610,6 +943,25 @@ process_op_16(struct disk_op_s *op)
         return ramdisk_process_op(op);
     case DTYPE_CDEMU:
         return cdemu_process_op(op);
+    case DTYPE_USB:
+        if ((CONFIG_BLOCK_CACHE && GET_GLOBAL(BlockCache))
+            || (CONFIG_BLOCK_READAHEAD && GET_GLOBAL(ReadAhead))) {
+            // Run usb drives in 32bit mode when possible, so that small
+            // sequential reads are merged into large bulk transfers by
+            // the read-ahead code.
+            int ret = call32(process_op_32, MAKE_FLATPTR(GET_SEG(SS), op), -1);
+            if (ret != -1)
+                return ret;
+            // Requests that modify the drive must not bypass the
+            // invalidation of cached and read-ahead sectors.
+            switch (op->command) {
+            case CMD_WRITE:
+            case CMD_FORMAT:
+            case CMD_SCSI:
+                return DISK_RET_EBADTRACK;
+            }
+        }
+        return usb_process_op(op);
     default:
         return process_op_both(op);
     }
@@ -59,6 +59,7 @@ struct drive_s {
     struct chs_s pchs;  // Physical CHS
     u32 max_segment_size; //max_segment_size
     u32 max_segments;   //max_segments
+    u32 max_sectors;    // Largest request sent to the device (0 if no limit)
 };
 
 #define DISK_SECTOR_SIZE  512
@@ -26,60 +26,80 @@ struct eltorito_s CDEmu VARLOW = { .size=sizeof(CDEmu) };
 struct drive_s *emulated_drive_gf VARLOW;
 struct drive_s *cdemu_drive_gf VARFSEG;
 
+// Cache of the last cdrom block fetched for a partial block read
+u8 *cdemu_cache_fl VARFSEG;
+u32 cdemu_cache_lba VARLOW = -1;
+
+// Make sure cdrom block @lba is held in the emulation cache
 static int
-cdemu_read(struct disk_op_s *op)
+cdemu_fill_cache(struct drive_s *drive_gf, u32 lba)
 {
-    struct drive_s *drive_gf = GET_LOW(emulated_drive_gf);
+    if (GET_LOW(cdemu_cache_lba) == lba)
+        return DISK_RET_SUCCESS;
     struct disk_op_s dop;
     dop.drive_fl = drive_gf;
-    dop.command = op->command;
-    dop.lba = GET_LOW(CDEmu.ilba) + op->lba / 4;
+    dop.command = CMD_READ;
+    dop.lba = lba;
+    dop.count = 1;
+    dop.buf_fl = GET_GLOBAL(cdemu_cache_fl);
+    SET_LOW(cdemu_cache_lba, -1);
+    int ret = process_op(&dop);
+    if (ret)
+        return ret;
+    SET_LOW(cdemu_cache_lba, lba);
+    return DISK_RET_SUCCESS;
+}
 
+static int
+cdemu_read(struct disk_op_s *op)
+{
+    struct drive_s *drive_gf = GET_LOW(emulated_drive_gf);
+    u8 *cache_fl = GET_GLOBAL(cdemu_cache_fl);
+    u32 lba = GET_LOW(CDEmu.ilba) + op->lba / 4;
+    int offset = op->lba & 3;
     int count = op->count;
     op->count = 0;
-    u8 *cdbuf_fl = GET_GLOBAL(bounce_buf_fl);
 
-    if (op->lba & 3) {
-        // Partial read of first block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+    if (count && (offset || count < 4)) {
+        // Partial read of first block - serve it from the cache.
+        int ret = cdemu_fill_cache(drive_gf, lba);
         if (ret)
             return ret;
-        u8 thiscount = 4 - (op->lba & 3);
+        int thiscount = 4 - offset;
         if (thiscount > count)
             thiscount = count;
         count -= thiscount;
-        memcpy_fl(op->buf_fl, cdbuf_fl + (op->lba & 3) * 512, thiscount * 512);
+        memcpy_fl(op->buf_fl, cache_fl + offset * 512, thiscount * 512);
         op->buf_fl += thiscount * 512;
         op->count += thiscount;
-        dop.lba++;
+        lba++;
     }
 
     if (count > 3) {
-        // Read n number of regular blocks.
+        // Read all whole blocks directly into the caller's buffer.
+        struct disk_op_s dop;
+        dop.drive_fl = drive_gf;
+        dop.command = op->command;
+        dop.lba = lba;
         dop.count = count / 4;
         dop.buf_fl = op->buf_fl;
         int ret = process_op(&dop);
         op->count += dop.count * 4;
         if (ret)
             return ret;
-        u8 thiscount = count & ~3;
+        int thiscount = count & ~3;
         count &= 3;
         op->buf_fl += thiscount * 512;
-        dop.lba += thiscount / 4;
+        lba += thiscount / 4;
     }
 
     if (count) {
-        // Partial read on last block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+        // Partial read on last block - keep it cached for the next read.
+        int ret = cdemu_fill_cache(drive_gf, lba);
         if (ret)
             return ret;
-        u8 thiscount = count;
-        memcpy_fl(op->buf_fl, cdbuf_fl, thiscount * 512);
-        op->count += thiscount;
+        memcpy_fl(op->buf_fl, cache_fl, count * 512);
+        op->count += count;
     }
 
     return DISK_RET_SUCCESS;
@@ -109,8 +129,13 @@ cdrom_prepboot(void)
         return;
     if (!CDCount)
         return;
-    if (create_bounce_buf() < 0)
+
+    u8 *cache = malloc_low(CDROM_SECTOR_SIZE);
+    if (!cache) {
+        warn_noalloc();
         return;
+    }
+    cdemu_cache_fl = cache;
 
     struct drive_s *drive = malloc_fseg(sizeof(*drive));
     if (!drive) {
@@ -189,6 +214,7 @@ cdrom_boot(struct drive_s *drive)
 
     // Fill in el-torito cdrom emulation fields.
     emulated_drive_gf = drive;
+    cdemu_cache_lba = -1;
     u8 media = buffer[0x21];
 
     u16 boot_segment = *(u16*)&buffer[0x22];
@@ -23,6 +23,9 @@
 #define AHCI_REQUEST_TIMEOUT 32000 // 32 seconds max for IDE ops
 #define AHCI_RESET_TIMEOUT     500 // 500 miliseconds
 #define AHCI_LINK_TIMEOUT       10 // 10 miliseconds
+#define AHCI_PHY_TIMEOUT       500 // 500 miliseconds once a device is seen
+
+#define AHCI_PRD_MAX_SECTORS  8192 // 4MB, the byte count limit of a prd entry
 
 // prepare sata command fis
 static void sata_prep_simple(struct sata_cmd_fis *fis, u8 command)
@@ -100,11 +103,84 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
+// error recovery (AHCI 1.3 section 6.2.2)
+static void ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr)
+{
+    u32 val;
+
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
+        dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+        mdelay (1);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+
+        // wait for the phy to re-establish communication (DET = 3)
+        u32 end = timer_calc(AHCI_PHY_TIMEOUT);
+        for (;;) {
+            val = ahci_port_readl(ctrl, pnr, PORT_SCR_STAT);
+            if ((val & PORT_SCR_STAT_DET) == PORT_SCR_STAT_DET_PHY)
+                break;
+            if (timer_check(end)) {
+                warn_timeout();
+                break;
+            }
+            yield();
+        }
+
+        // clear PxSERR again so the device's D2H fis updates PxTFD
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+        // wait for the device to become ready
+        end = timer_calc(AHCI_REQUEST_TIMEOUT);
+        for (;;) {
+            val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+            if (!(val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)))
+                break;
+            if (timer_check(end)) {
+                warn_timeout();
+                dprintf(1, "AHCI/%d: device not ready (tf 0x%x)\n", pnr, val);
+                break;
+            }
+            yield();
+        }
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+}
+
 // submit ahci command + wait for result
 static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
                         void *buffer, u32 bsize)
 {
-    u32 val, status, success, flags, intbits, error;
+    u32 status, success, flags, intbits, error;
     struct ahci_ctrl_s *ctrl = port_gf->ctrl;
     struct ahci_cmd_s  *cmd  = port_gf->cmd;
     struct ahci_fis_s  *fis  = port_gf->fis;
@@ -174,43 +250,7 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
     } else {
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
-
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
-
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
-
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
-
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
-
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
-        }
-
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        ahci_port_recover(ctrl, pnr);
     }
     return success ? 0 : -1;
 }
@@ -247,13 +287,25 @@ ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
     struct ahci_cmd_s *cmd = port_gf->cmd;
     int rc;
 
-    sata_prep_readwrite(&cmd->fis, op, iswrite);
-    rc = ahci_command(port_gf, iswrite, 0, op->buf_fl,
-                      op->count * DISK_SECTOR_SIZE);
-    dprintf(8, "ahci disk %s, lba %6x, count %3x, buf %p, rc %d\n",
-            iswrite ? "write" : "read", (u32)op->lba, op->count, op->buf_fl, rc);
-    if (rc < 0)
-        return DISK_RET_EBADTRACK;
+    // A single command's prd entry can only describe 4MB.  Larger
+    // requests (possible from 32bit callers) are sent as several commands.
+    struct disk_op_s localop = *op;
+    u16 remaining = op->count;
+    while (remaining) {
+        localop.count = (remaining < AHCI_PRD_MAX_SECTORS
+                         ? remaining : AHCI_PRD_MAX_SECTORS);
+        sata_prep_readwrite(&cmd->fis, &localop, iswrite);
+        rc = ahci_command(port_gf, iswrite, 0, localop.buf_fl,
+                          localop.count * DISK_SECTOR_SIZE);
+        dprintf(8, "ahci disk %s, lba %6x, count %3x, buf %p, rc %d\n",
+                iswrite ? "write" : "read", (u32)localop.lba, localop.count,
+                localop.buf_fl, rc);
+        if (rc < 0)
+            return DISK_RET_EBADTRACK;
+        remaining -= localop.count;
+        localop.lba += localop.count;
+        localop.buf_fl += localop.count * DISK_SECTOR_SIZE;
+    }
     return DISK_RET_SUCCESS;
 }
 
@@ -447,15 +499,27 @@ static int ahci_port_setup(struct ahci_port_s *port)
     cmd &= ~PORT_CMD_ICC_MASK;
     cmd |= PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON | PORT_CMD_ICC_ACTIVE;
     ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
+    // An empty port never leaves DET=0, so only wait briefly for it.  Once
+    // a device is detected give the phy longer to establish communication.
     u32 end = timer_calc(AHCI_LINK_TIMEOUT);
+    int present = 0;
     for (;;) {
         stat = ahci_port_readl(ctrl, pnr, PORT_SCR_STAT);
-        if ((stat & 0x07) == 0x03) {
+        u32 det = stat & PORT_SCR_STAT_DET;
+        if (det == PORT_SCR_STAT_DET_PHY) {
             dprintf(2, "AHCI/%d: link up\n", port->pnr);
             break;
         }
+        if (det == PORT_SCR_STAT_DET_OFFLINE) {
+            dprintf(2, "AHCI/%d: phy offline\n", port->pnr);
+            return -1;
+        }
+        if (det == PORT_SCR_STAT_DET_PRESENT && !present) {
+            present = 1;
+            end = timer_calc(AHCI_PHY_TIMEOUT);
+        }
         if (timer_check(end)) {
-            dprintf(2, "AHCI/%d: link down\n", port->pnr);
+            dprintf(2, "AHCI/%d: link down (det %d)\n", port->pnr, det);
             return -1;
         }
         yield();
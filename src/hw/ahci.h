@@ -133,6 +133,13 @@ int ahci_atapi_process_op(struct disk_op_s *op);
 #define PORT_CMD_ISSUE            0x38 /* command issue */
 #define PORT_RESERVED             0x3c /* reserved */
 
+/* PORT_SCR_STAT bits */
+#define PORT_SCR_STAT_DET         (0xf << 0) /* device detection */
+#define PORT_SCR_STAT_DET_NONE    (0x0 << 0) /* no device, no phy comm */
+#define PORT_SCR_STAT_DET_PRESENT (0x1 << 0) /* device, no phy comm */
+#define PORT_SCR_STAT_DET_PHY     (0x3 << 0) /* device and phy comm */
+#define PORT_SCR_STAT_DET_OFFLINE (0x4 << 0) /* phy offline */
+
 /* PORT_IRQ_{STAT,MASK} bits */
 #define PORT_IRQ_COLD_PRES        (1 << 31) /* cold presence detect */
 #define PORT_IRQ_TF_ERR           (1 << 30) /* task file error */
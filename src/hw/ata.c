@@ -189,8 +189,9 @@ send_cmd(struct atadrive_s *adrive_gf, struct ata_pio_command *cmd)
             return status;
     }
 
-    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA)_EXT commands.
-    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT) {
+    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA|MULTIPLE)_EXT commands.
+    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT
+        || (cmd->command & ~0x10) == ATA_CMD_READ_MULTIPLE_EXT) {
         outb(cmd->feature2, iobase1 + ATA_CB_FR);
         outb(cmd->sector_count2, iobase1 + ATA_CB_SC);
         outb(cmd->lba_low2, iobase1 + ATA_CB_SN);
@@ -265,15 +266,32 @@ fail:
     return ret;
 }
 
+// Program the drive's READ/WRITE MULTIPLE block size.
+static int
+ata_set_multiple(struct atadrive_s *adrive_gf)
+{
+    u8 multi = GET_GLOBALFLAT(adrive_gf->multi);
+    if (!multi)
+        return 0;
+    struct ata_pio_command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = ATA_CMD_SET_MULTIPLE_MODE;
+    cmd.sector_count = multi;
+    int ret = ata_cmd_nondata(adrive_gf, &cmd);
+    if (ret)
+        dprintf(1, "ata: set multiple mode %d failed (%d)\n", multi, ret);
+    return ret;
+}
+
 
 /****************************************************************
  * ATA PIO transfers
  ****************************************************************/
 
 // Transfer 'op->count' blocks (of 'blocksize' bytes) to/from drive
-// 'op->drive_fl'.
+// 'op->drive_fl'.  The drive requests 'multi' blocks per DRQ.
 static int
-ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
+ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize, int multi)
 {
     dprintf(16, "ata_pio_transfer id=%p write=%d count=%d bs=%d buf=%p\n"
             , op->drive_fl, iswrite, op->count, blocksize, op->buf_fl);
@@ -283,26 +301,29 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
     struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
     u16 iobase1 = GET_GLOBALFLAT(chan_gf->iobase1);
     u16 iobase2 = GET_GLOBALFLAT(chan_gf->iobase2);
+    int pio32 = CONFIG_ATA_PIO32 && !(blocksize % 4);
     int count = op->count;
     void *buf_fl = op->buf_fl;
     int status;
     for (;;) {
+        int blocks = count < multi ? count : multi;
+        u32 bytes = blocks * blocksize;
         if (iswrite) {
             // Write data to controller
             dprintf(16, "Write sector id=%p dest=%p\n", op->drive_fl, buf_fl);
-            if (CONFIG_ATA_PIO32)
-                outsl_fl(iobase1, buf_fl, blocksize / 4);
+            if (pio32)
+                outsl_fl(iobase1, buf_fl, bytes / 4);
             else
-                outsw_fl(iobase1, buf_fl, blocksize / 2);
+                outsw_fl(iobase1, buf_fl, bytes / 2);
         } else {
             // Read data from controller
             dprintf(16, "Read sector id=%p dest=%p\n", op->drive_fl, buf_fl);
-            if (CONFIG_ATA_PIO32)
-                insl_fl(iobase1, buf_fl, blocksize / 4);
+            if (pio32)
+                insl_fl(iobase1, buf_fl, bytes / 4);
             else
-                insw_fl(iobase1, buf_fl, blocksize / 2);
+                insw_fl(iobase1, buf_fl, bytes / 2);
         }
-        buf_fl += blocksize;
+        buf_fl += bytes;
 
         status = pause_await_not_bsy(iobase1, iobase2);
         if (status < 0) {
@@ -311,7 +332,7 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
             return status;
         }
 
-        count--;
+        count -= blocks;
         if (!count)
             break;
         status &= (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ | ATA_CB_STAT_ERR);
@@ -463,7 +484,8 @@ ata_dma_transfer(struct disk_op_s *op)
 
 // Transfer data to harddrive using PIO protocol.
 static int
-ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
+ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd
+                 , int multi)
 {
     struct atadrive_s *adrive_gf = container_of(
         op->drive_fl, struct atadrive_s, drive);
@@ -480,7 +502,7 @@ ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
     ret = ata_wait_data(iobase1);
     if (ret)
         goto fail;
-    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE);
+    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE, multi);
 
 fail:
     // Enable interrupts
@@ -502,13 +524,18 @@ ata_dma_cmd_data(struct disk_op_s *op, struct ata_pio_command *cmd)
     return ata_dma_transfer(op);
 }
 
-// Read/write count blocks from a harddrive.
+// Issue a read/write command using either PIO or a prepared DMA transfer.
 static int
-ata_readwrite(struct disk_op_s *op, int iswrite)
+ata_readwrite_cmd(struct disk_op_s *op, int iswrite, int usepio)
 {
     u64 lba = op->lba;
 
-    int usepio = ata_try_dma(op, iswrite, DISK_SECTOR_SIZE);
+    int multi = 1;
+    if (usepio) {
+        struct atadrive_s *adrive_gf = container_of(
+            op->drive_fl, struct atadrive_s, drive);
+        multi = GET_GLOBALFLAT(adrive_gf->multi) ?: 1;
+    }
 
     struct ata_pio_command cmd;
     memset(&cmd, 0, sizeof(cmd));
@@ -520,14 +547,20 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
         cmd.lba_high2 = lba >> 40;
         lba &= 0xffffff;
 
-        if (usepio)
+        if (usepio && multi > 1)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE_EXT
+                           : ATA_CMD_READ_MULTIPLE_EXT);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS_EXT
                            : ATA_CMD_READ_SECTORS_EXT);
         else
             cmd.command = (iswrite ? ATA_CMD_WRITE_DMA_EXT
                            : ATA_CMD_READ_DMA_EXT);
     } else {
-        if (usepio)
+        if (usepio && multi > 1)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE
+                           : ATA_CMD_READ_MULTIPLE);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS
                            : ATA_CMD_READ_SECTORS);
         else
@@ -541,12 +574,32 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
     cmd.lba_high = lba >> 16;
     cmd.device = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 
-    int ret;
     if (usepio)
-        ret = ata_pio_cmd_data(op, iswrite, &cmd);
-    else
-        ret = ata_dma_cmd_data(op, &cmd);
-    if (ret)
+        return ata_pio_cmd_data(op, iswrite, &cmd, multi);
+    return ata_dma_cmd_data(op, &cmd);
+}
+
+// Read/write count blocks from a harddrive.
+static int
+ata_readwrite(struct disk_op_s *op, int iswrite)
+{
+    int usepio = ata_try_dma(op, iswrite, DISK_SECTOR_SIZE);
+    if (!usepio) {
+        if (!ata_readwrite_cmd(op, iswrite, 0))
+            return DISK_RET_SUCCESS;
+        // The drive may still be busy with the failed command - stop
+        // the bus master and reset the channel before retrying with PIO.
+        dprintf(1, "ata: DMA transfer failed - retrying with PIO\n");
+        struct atadrive_s *adrive_gf = container_of(
+            op->drive_fl, struct atadrive_s, drive);
+        struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
+        u16 iomaster = GET_GLOBALFLAT(chan_gf->iomaster);
+        outb(inb(iomaster + BM_CMD) & ~BM_CMD_START, iomaster + BM_CMD);
+        outb(BM_STATUS_ERROR|BM_STATUS_IRQ, iomaster + BM_STATUS);
+        ata_reset(adrive_gf);
+        ata_set_multiple(adrive_gf);
+    }
+    if (ata_readwrite_cmd(op, iswrite, 1))
         return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
 }
@@ -567,6 +620,7 @@ ata_process_op(struct disk_op_s *op)
         return ata_readwrite(op, 1);
     case CMD_RESET:
         ata_reset(adrive_gf);
+        ata_set_multiple(adrive_gf);
         return DISK_RET_SUCCESS;
     case CMD_ISREADY:
         return isready(adrive_gf);
@@ -643,7 +697,7 @@ ata_atapi_process_op(struct disk_op_s *op)
             goto fail;
         }
 
-        ret = ata_pio_transfer(op, 0, blocksize);
+        ret = ata_pio_transfer(op, 0, blocksize, 1);
     }
 
 fail:
@@ -676,7 +730,7 @@ send_ata_identity(struct atadrive_s *adrive, u16 *buffer, int command)
     memset(&cmd, 0, sizeof(cmd));
     cmd.command = command;
 
-    return ata_pio_cmd_data(&dop, 0, &cmd);
+    return ata_pio_cmd_data(&dop, 0, &cmd, 1);
 }
 
 // Extract the ATA/ATAPI version info.
@@ -781,6 +835,14 @@ init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
     adrive->drive.type = DTYPE_ATA;
     adrive->drive.blksize = DISK_SECTOR_SIZE;
 
+    // word 47 - maximum sectors per DRQ block for READ/WRITE MULTIPLE
+    u8 maxmulti = buffer[47] & 0xff;
+    if ((buffer[47] & 0xff00) == 0x8000 && maxmulti > 1) {
+        adrive->multi = 1 << __fls(maxmulti);
+        if (ata_set_multiple(adrive))
+            adrive->multi = 0;
+    }
+
     adrive->drive.pchs.cylinder = buffer[1];
     adrive->drive.pchs.head = buffer[3];
     adrive->drive.pchs.sector = buffer[6];
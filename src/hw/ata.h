@@ -20,6 +20,7 @@ struct atadrive_s {
     struct drive_s drive;
     struct ata_channel_s *chan_gf;
     u8 slave;
+    u8 multi;   // Sectors per DRQ block for READ/WRITE MULTIPLE (0 = off)
 };
 
 // ata.c
@@ -10,6 +10,7 @@
 #include "byteorder.h" // be32_to_cpu
 #include "farptr.h" // GET_FLATPTR
 #include "output.h" // dprintf
+#include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_EPARAM
 #include "string.h" // memset
 #include "util.h" // timer_calc
@@ -162,6 +163,51 @@ scsi_is_read(struct disk_op_s *op)
         !MODESEGMENT && op->command == CMD_SCSI && op->blocksize);
 }
 
+// Don't split a transfer into requests smaller than this many blocks
+#define SCSI_SPLIT_MIN_BLOCKS 16
+
+static u16
+scsi_split_blocks(struct disk_op_s *op, int maxreqs)
+{
+    if (op->command != CMD_READ && op->command != CMD_WRITE)
+        return op->count;
+    u16 blocks = DIV_ROUND_UP(op->count, maxreqs);
+    return blocks < SCSI_SPLIT_MIN_BLOCKS ? SCSI_SPLIT_MIN_BLOCKS : blocks;
+}
+
+// Set up @subop as the first of up to @maxreqs requests that together
+// carry out @op, so that an HBA can have them all in flight at once.
+// Returns the number of requests needed.
+int
+scsi_split_init(struct disk_op_s *op, struct disk_op_s *subop, int maxreqs)
+{
+    u16 blocks = scsi_split_blocks(op, maxreqs);
+    *subop = *op;
+    if (subop->count > blocks)
+        subop->count = blocks;
+    if (!op->count)
+        return 1;
+    return DIV_ROUND_UP(op->count, blocks);
+}
+
+// Advance @subop past a request of @blocksize sized blocks.  Returns
+// zero once all of @op has been covered.
+int
+scsi_split_next(struct disk_op_s *op, struct disk_op_s *subop, int maxreqs,
+                int blocksize)
+{
+    u16 done = subop->lba - op->lba + subop->count;
+    if (done >= op->count)
+        return 0;
+    u16 blocks = scsi_split_blocks(op, maxreqs);
+    subop->buf_fl += subop->count * blocksize;
+    subop->lba += subop->count;
+    subop->count = op->count - done;
+    if (subop->count > blocks)
+        subop->count = blocks;
+    return 1;
+}
+
 // Check if a SCSI device is ready to receive commands
 int
 scsi_is_ready(struct disk_op_s *op)
@@ -302,11 +348,64 @@ int scsi_sequential_scan(struct drive_s *tmp_drive, u32 maxluns,
     int ret;
     u32 lun;
 
+    // A target that doesn't answer INQUIRY on lun 0 isn't there - don't
+    // probe each of its luns.
+    struct cdbres_inquiry data;
+    struct disk_op_s op;
+    memset(&op, 0, sizeof(op));
+    op.drive_fl = tmp_drive;
+    if (cdb_get_inquiry(&op, &data))
+        return 0;
+
     for (lun = 0, ret = 0; lun < maxluns; lun++)
         ret += !add_lun(lun, tmp_drive);
     return ret;
 }
 
+struct scsi_scan_s {
+    void *hba;
+    scsi_scan_target scan_target;
+    u32 next, maxtarget;
+    int running, found;
+};
+
+static void
+scsi_scan_worker(void *data)
+{
+    struct scsi_scan_s *ss = data;
+    for (;;) {
+        u32 target = ss->next;
+        if (target >= ss->maxtarget)
+            break;
+        ss->next++;
+        int ret = ss->scan_target(ss->hba, target);
+        if (ret > 0)
+            ss->found += ret;
+    }
+    ss->running--;
+}
+
+// Call @scan_target for targets 0 to @maxtarget-1 of an HBA, with up to
+// @maxthreads targets probed at once.  Returns the number of luns found.
+int scsi_scan_targets(void *hba, u32 maxtarget, int maxthreads,
+                      scsi_scan_target scan_target)
+{
+    ASSERT32FLAT();
+    struct scsi_scan_s ss = {
+        .hba = hba,
+        .scan_target = scan_target,
+        .maxtarget = maxtarget,
+    };
+    int i;
+    for (i = 0; i < maxthreads && ss.next < maxtarget; i++) {
+        ss.running++;
+        run_thread(scsi_scan_worker, &ss);
+    }
+    while (ss.running)
+        yield();
+    return ss.found;
+}
+
 // Validate drive, find block size / sector count, and register drive.
 int
 scsi_drive_setup(struct drive_s *drive, const char *s, int prio)
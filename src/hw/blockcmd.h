@@ -130,6 +130,10 @@ struct cdbres_mode_sense_geom {
 struct disk_op_s;
 int scsi_fill_cmd(struct disk_op_s *op, void *cdbcmd, int maxcdb);
 int scsi_is_read(struct disk_op_s *op);
+int scsi_split_init(struct disk_op_s *op, struct disk_op_s *subop,
+                    int maxreqs);
+int scsi_split_next(struct disk_op_s *op, struct disk_op_s *subop, int maxreqs,
+                    int blocksize);
 int scsi_is_ready(struct disk_op_s *op);
 struct drive_s;
 int scsi_drive_setup(struct drive_s *drive, const char *s, int prio);
@@ -137,5 +141,8 @@ typedef int (*scsi_add_lun)(u32 lun, struct drive_s *tmpl_drv);
 int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun);
 int scsi_sequential_scan(struct drive_s *tmp_drive, u32 maxluns,
                          scsi_add_lun add_lun);
+typedef int (*scsi_scan_target)(void *hba, u32 target);
+int scsi_scan_targets(void *hba, u32 maxtarget, int maxthreads,
+                      scsi_scan_target scan_target);
 
 #endif // blockcmd.h
@@ -220,14 +220,15 @@ fail:
     return -1;
 }
 
-static void
-esp_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+static int
+esp_scsi_scan_target(void *hba, u32 target)
 {
+    struct esp_lun_s *tmpl_llun = hba;
     struct esp_lun_s llun0;
 
-    esp_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    esp_scsi_init_lun(&llun0, tmpl_llun->pci, tmpl_llun->iobase, target, 0);
 
-    scsi_rep_luns_scan(&llun0.drive, esp_scsi_add_lun);
+    return scsi_rep_luns_scan(&llun0.drive, esp_scsi_add_lun);
 }
 
 static void
@@ -244,9 +245,10 @@ init_esp_scsi(void *data)
     // reset
     outb(ESP_CMD_RESET, iobase + ESP_CMD);
 
-    int i;
-    for (i = 0; i <= 7; i++)
-        esp_scsi_scan_target(pci, iobase, i);
+    // The controller runs one command at a time, so scan targets in turn
+    struct esp_lun_s tmpl_llun;
+    esp_scsi_init_lun(&tmpl_llun, pci, iobase, 0, 0);
+    scsi_scan_targets(&tmpl_llun, 8, 1, esp_scsi_scan_target);
 }
 
 void
@@ -174,15 +174,18 @@ fail:
     return -1;
 }
 
-static void
-lsi_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+static int
+lsi_scsi_scan_target(void *hba, u32 target)
 {
+    struct lsi_lun_s *tmpl_llun = hba;
     struct lsi_lun_s llun0;
 
-    lsi_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    lsi_scsi_init_lun(&llun0, tmpl_llun->pci, tmpl_llun->iobase, target, 0);
 
-    if (scsi_rep_luns_scan(&llun0.drive, lsi_scsi_add_lun) < 0)
-        scsi_sequential_scan(&llun0.drive, 8, lsi_scsi_add_lun);
+    int ret = scsi_rep_luns_scan(&llun0.drive, lsi_scsi_add_lun);
+    if (ret < 0)
+        ret = scsi_sequential_scan(&llun0.drive, 8, lsi_scsi_add_lun);
+    return ret;
 }
 
 static void
@@ -199,9 +202,10 @@ init_lsi_scsi(void *data)
     // reset
     outb(LSI_ISTAT0_SRST, iobase + LSI_REG_ISTAT0);
 
-    int i;
-    for (i = 0; i < 7; i++)
-        lsi_scsi_scan_target(pci, iobase, i);
+    // The controller runs one command at a time, so scan targets in turn
+    struct lsi_lun_s tmpl_llun;
+    lsi_scsi_init_lun(&tmpl_llun, pci, iobase, 0, 0);
+    scsi_scan_targets(&tmpl_llun, 7, 1, lsi_scsi_scan_target);
 }
 
 void
@@ -108,21 +108,34 @@ struct mfi_ld_list_s {
 
 #define MEGASAS_POLL_TIMEOUT 60000 // 60 seconds polling timeout
 
+#define MFI_STATE_MAX_CMDS_MASK       0x0000ffff
+
+// Maximum number of frames posted by a single disk_op
+#define MEGASAS_MAX_FRAMES 4
+// The firmware fetches frames in 64 byte units from 64 byte aligned
+// addresses - the low address bits carry the frame count.
+#define MEGASAS_FRAME_SIZE 64
+
 struct megasas_lun_s {
     struct drive_s drive;
-    struct megasas_cmd_frame *frame;
+    void *frames;
     u32 iobase;
     u16 pci_id;
+    u8 nframes;
     u8 target;
     u8 lun;
 };
 
-static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
-                            struct megasas_cmd_frame *frame)
+static struct megasas_cmd_frame *megasas_frame(void *frames, int i)
+{
+    return frames + i * MEGASAS_FRAME_SIZE;
+}
+
+static void megasas_post_frame(u16 pci_id, u32 ioaddr,
+                               struct megasas_cmd_frame *frame)
 {
     u32 frame_addr = (u32)frame;
     int frame_count = 1;
-    u8 cmd_state;
 
     dprintf(2, "Frame 0x%x\n", frame_addr);
     if (pci_id == PCI_DEVICE_ID_LSI_SAS2004 ||
@@ -136,6 +149,12 @@ static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
     } else {
         outl(frame_addr | frame_count << 1 | 1, ioaddr + MFI_IQP);
     }
+}
+
+static int megasas_wait_frame(struct megasas_cmd_frame *frame)
+{
+    u32 frame_addr = (u32)frame;
+    u8 cmd_state;
 
     u32 end = timer_calc(MEGASAS_POLL_TIMEOUT);
     do {
@@ -157,52 +176,78 @@ static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
     return -1;
 }
 
+static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
+                            struct megasas_cmd_frame *frame)
+{
+    megasas_post_frame(pci_id, ioaddr, frame);
+    return megasas_wait_frame(frame);
+}
+
 int
 megasas_process_op(struct disk_op_s *op)
 {
     if (!CONFIG_MEGASAS)
         return DISK_RET_EBADTRACK;
-    u8 cdb[16];
-    int blocksize = scsi_fill_cmd(op, cdb, sizeof(cdb));
-    if (blocksize < 0)
-        return default_process_op(op);
     struct megasas_lun_s *mlun_gf =
         container_of(op->drive_fl, struct megasas_lun_s, drive);
-    struct megasas_cmd_frame *frame = GET_GLOBALFLAT(mlun_gf->frame);
+    void *frames = GET_GLOBALFLAT(mlun_gf->frames);
     u16 pci_id = GET_GLOBALFLAT(mlun_gf->pci_id);
+    u32 iobase = GET_GLOBALFLAT(mlun_gf->iobase);
+    int nframes = GET_GLOBALFLAT(mlun_gf->nframes);
     int i;
 
-    memset_fl(frame, 0, sizeof(*frame));
-    SET_LOWFLAT(frame->cmd, MFI_CMD_LD_SCSI_IO);
-    SET_LOWFLAT(frame->cmd_status, 0xFF);
-    SET_LOWFLAT(frame->target_id, GET_GLOBALFLAT(mlun_gf->target));
-    SET_LOWFLAT(frame->lun, GET_GLOBALFLAT(mlun_gf->lun));
-    SET_LOWFLAT(frame->flags, 0x0001);
-    SET_LOWFLAT(frame->data_xfer_len, op->count * blocksize);
-    SET_LOWFLAT(frame->cdb_len, 16);
-
-    for (i = 0; i < 16; i++) {
-        SET_LOWFLAT(frame->pthru.cdb[i], cdb[i]);
-    }
-    dprintf(2, "pthru cmd 0x%x count %d bs %d\n",
-            cdb[0], op->count, blocksize);
+    // Split large reads and writes into frames the firmware can work
+    // on in parallel
+    struct disk_op_s subop;
+    scsi_split_init(op, &subop, nframes);
+    int posted = 0, blocksize;
+    do {
+        struct megasas_cmd_frame *frame = megasas_frame(frames, posted);
+        u8 cdb[16];
+        blocksize = scsi_fill_cmd(&subop, cdb, sizeof(cdb));
+        if (blocksize < 0)
+            return default_process_op(op);
+        u32 len = subop.count * blocksize;
+
+        memset_fl(frame, 0, sizeof(*frame));
+        SET_LOWFLAT(frame->cmd, MFI_CMD_LD_SCSI_IO);
+        SET_LOWFLAT(frame->cmd_status, 0xFF);
+        SET_LOWFLAT(frame->target_id, GET_GLOBALFLAT(mlun_gf->target));
+        SET_LOWFLAT(frame->lun, GET_GLOBALFLAT(mlun_gf->lun));
+        SET_LOWFLAT(frame->flags, 0x0001);
+        SET_LOWFLAT(frame->data_xfer_len, len);
+        SET_LOWFLAT(frame->cdb_len, 16);
+
+        for (i = 0; i < 16; i++) {
+            SET_LOWFLAT(frame->pthru.cdb[i], cdb[i]);
+        }
+        dprintf(2, "pthru cmd 0x%x count %d bs %d\n",
+                cdb[0], subop.count, blocksize);
 
-    if (op->count) {
-        SET_LOWFLAT(frame->pthru.sgl_addr, (u32)op->buf_fl);
-        SET_LOWFLAT(frame->pthru.sgl_len, op->count * blocksize);
-        SET_LOWFLAT(frame->sge_count, 1);
-    }
-    SET_LOWFLAT(frame->context, (u32)frame);
+        if (subop.count) {
+            SET_LOWFLAT(frame->pthru.sgl_addr, (u32)subop.buf_fl);
+            SET_LOWFLAT(frame->pthru.sgl_len, len);
+            SET_LOWFLAT(frame->sge_count, 1);
+        }
+        SET_LOWFLAT(frame->context, (u32)frame);
 
-    if (megasas_fire_cmd(pci_id, GET_GLOBALFLAT(mlun_gf->iobase), frame) == 0)
-        return DISK_RET_SUCCESS;
+        megasas_post_frame(pci_id, iobase, frame);
+        posted++;
+    } while (scsi_split_next(op, &subop, nframes, blocksize));
 
-    dprintf(2, "pthru cmd 0x%x failed\n", cdb[0]);
-    return DISK_RET_EBADTRACK;
+    int ret = DISK_RET_SUCCESS;
+    for (i = 0; i < posted; i++) {
+        if (megasas_wait_frame(megasas_frame(frames, i)) != 0) {
+            dprintf(2, "pthru cmd failed\n");
+            ret = DISK_RET_EBADTRACK;
+        }
+    }
+    return ret;
 }
 
 static int
-megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
+megasas_add_lun(struct pci_device *pci, u32 iobase, int max_cmds,
+                u8 target, u8 lun)
 {
     struct megasas_lun_s *mlun = malloc_fseg(sizeof(*mlun));
     char *name;
@@ -219,8 +264,12 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
     mlun->target = target;
     mlun->lun = lun;
     mlun->iobase = iobase;
-    mlun->frame = memalign_low(256, sizeof(struct megasas_cmd_frame));
-    if (!mlun->frame) {
+    mlun->nframes = max_cmds < MEGASAS_MAX_FRAMES ? max_cmds
+                                                  : MEGASAS_MAX_FRAMES;
+    if (!mlun->nframes)
+        mlun->nframes = 1;
+    mlun->frames = memalign_low(256, MEGASAS_FRAME_SIZE * mlun->nframes);
+    if (!mlun->frames) {
         warn_noalloc();
         free(mlun);
         return -1;
@@ -232,7 +281,7 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
     ret = scsi_drive_setup(&mlun->drive, name, prio);
     free(name);
     if (ret) {
-        free(mlun->frame);
+        free(mlun->frames);
         free(mlun);
         ret = -1;
     }
@@ -240,7 +289,8 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
     return ret;
 }
 
-static void megasas_scan_target(struct pci_device *pci, u32 iobase)
+static void megasas_scan_target(struct pci_device *pci, u32 iobase,
+                                int max_cmds)
 {
     struct mfi_ld_list_s ld_list;
     struct megasas_cmd_frame *frame = memalign_tmp(256, sizeof(*frame));
@@ -270,22 +320,26 @@ static void megasas_scan_target(struct pci_device *pci, u32 iobase)
                     ld_list.lds[i].target, ld_list.lds[i].lun,
                     ld_list.lds[i].state);
             if (ld_list.lds[i].state != 0) {
-                megasas_add_lun(pci, iobase,
+                megasas_add_lun(pci, iobase, max_cmds,
                                 ld_list.lds[i].target, ld_list.lds[i].lun);
             }
         }
     }
 }
 
+static u32 megasas_read_fw_state(struct pci_device *pci, u32 ioaddr)
+{
+    if (pci->device == PCI_DEVICE_ID_LSI_SAS1064R ||
+        pci->device == PCI_DEVICE_ID_DELL_PERC5)
+        return inl(ioaddr + MFI_OMSG0);
+    return inl(ioaddr + MFI_OSP0);
+}
+
 static int megasas_transition_to_ready(struct pci_device *pci, u32 ioaddr)
 {
     u32 fw_state = 0, new_state, mfi_flags = 0;
 
-    if (pci->device == PCI_DEVICE_ID_LSI_SAS1064R ||
-        pci->device == PCI_DEVICE_ID_DELL_PERC5)
-        new_state = inl(ioaddr + MFI_OMSG0) & MFI_STATE_MASK;
-    else
-        new_state = inl(ioaddr + MFI_OSP0) & MFI_STATE_MASK;
+    new_state = megasas_read_fw_state(pci, ioaddr) & MFI_STATE_MASK;
 
     while (fw_state != new_state) {
         switch (new_state) {
@@ -343,11 +397,7 @@ static int megasas_transition_to_ready(struct pci_device *pci, u32 ioaddr)
             }
             yield();
             fw_state = new_state;
-            if (pci->device == PCI_DEVICE_ID_LSI_SAS1064R ||
-                pci->device == PCI_DEVICE_ID_DELL_PERC5)
-                new_state = inl(ioaddr + MFI_OMSG0) & MFI_STATE_MASK;
-            else
-                new_state = inl(ioaddr + MFI_OSP0) & MFI_STATE_MASK;
+            new_state = megasas_read_fw_state(pci, ioaddr) & MFI_STATE_MASK;
             if (new_state != fw_state) {
                 break;
             }
@@ -372,8 +422,13 @@ init_megasas(void *data)
     dprintf(1, "found MegaRAID SAS at %pP, io @ %x\n", pci, iobase);
 
     // reset
-    if (megasas_transition_to_ready(pci, iobase) == 0)
-        megasas_scan_target(pci, iobase);
+    if (megasas_transition_to_ready(pci, iobase) != 0)
+        return;
+
+    // The firmware reports how many commands it can have outstanding
+    int max_cmds = megasas_read_fw_state(pci, iobase) & MFI_STATE_MAX_CMDS_MASK;
+    dprintf(2, "MegaRAID SAS fw max_cmds %d\n", max_cmds);
+    megasas_scan_target(pci, iobase, max_cmds);
 }
 
 void
@@ -238,15 +238,18 @@ fail:
     return -1;
 }
 
-static void
-mpt_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+static int
+mpt_scsi_scan_target(void *hba, u32 target)
 {
+    struct mpt_lun_s *tmpl_llun = hba;
     struct mpt_lun_s llun0;
 
-    mpt_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    mpt_scsi_init_lun(&llun0, tmpl_llun->pci, tmpl_llun->iobase, target, 0);
 
-    if (scsi_rep_luns_scan(&llun0.drive, mpt_scsi_add_lun) < 0)
-        scsi_sequential_scan(&llun0.drive, 8, mpt_scsi_add_lun);
+    int ret = scsi_rep_luns_scan(&llun0.drive, mpt_scsi_add_lun);
+    if (ret < 0)
+        ret = scsi_sequential_scan(&llun0.drive, 8, mpt_scsi_add_lun);
+    return ret;
 }
 
 static inline void
@@ -295,9 +298,10 @@ init_mpt_scsi(void *data)
     // Post reply message used for SCSI errors
     outl((u32)&reply_msg[0], iobase + MPT_REG_REP_Q);
 
-    int i;
-    for (i = 0; i < 7; i++)
-        mpt_scsi_scan_target(pci, iobase, i);
+    // The controller runs one command at a time, so scan targets in turn
+    struct mpt_lun_s tmpl_llun;
+    mpt_scsi_init_lun(&tmpl_llun, pci, iobase, 0, 0);
+    scsi_scan_targets(&tmpl_llun, 7, 1, mpt_scsi_scan_target);
 }
 
 void
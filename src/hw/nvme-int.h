@@ -62,6 +62,8 @@ struct nvme_cqe {
 /* The common part of every submission or completion queue. */
 struct nvme_queue {
     u32 *dbl;                   /* doorbell */
+    u32 *dbbuf_db;              /* shadow doorbell (or NULL) */
+    u32 *dbbuf_ei;              /* shadow doorbell EventIdx */
     u16 mask;                   /* length - 1 */
 };
 
@@ -97,6 +99,9 @@ struct nvme_ctrl {
 
     u32 doorbell_stride;        /* in bytes */
 
+    u32 *dbbuf_db;              /* shadow doorbell buffer (or NULL) */
+    u32 *dbbuf_ei;              /* EventIdx buffer */
+
     struct nvme_sq admin_sq;
     struct nvme_cq admin_cq;
 
@@ -133,7 +138,11 @@ struct nvme_identify_ctrl {
     u8 cmic;
     u8 mdts;
 
-    char _boring[516 - 78];
+    char _boring[256 - 78];
+
+    u16 oacs;                   /* optional admin command support */
+
+    char _boring2[516 - 258];
 
     u32 nn;                     /* number of namespaces */
 };
@@ -179,6 +188,7 @@ union nvme_identify {
 #define NVME_SQE_OPC_ADMIN_CREATE_IO_SQ 1U
 #define NVME_SQE_OPC_ADMIN_CREATE_IO_CQ 5U
 #define NVME_SQE_OPC_ADMIN_IDENTIFY     6U
+#define NVME_SQE_OPC_ADMIN_DBBUF_CONFIG 0x7CU
 
 #define NVME_SQE_OPC_IO_WRITE 1U
 #define NVME_SQE_OPC_IO_READ  2U
@@ -187,6 +197,8 @@ union nvme_identify {
 #define NVME_ADMIN_IDENTIFY_CNS_ID_CTRL     1U
 #define NVME_ADMIN_IDENTIFY_CNS_GET_NS_LIST 2U
 
+#define NVME_CTRL_OACS_DBBUF (1U << 8)
+
 #define NVME_CQE_DW3_P (1U << 16)
 
 #define NVME_PAGE_SIZE 4096
@@ -20,9 +20,20 @@
 #include "nvme.h"
 #include "nvme-int.h"
 
-// Page aligned "dma bounce buffer" of size NVME_PAGE_SIZE in high memory
+// Maximum number of I/O commands queued at once by a single disk_op
+#define NVME_MAX_INFLIGHT 8
+
+// Page aligned "dma bounce buffers" in high memory - one page of size
+// NVME_PAGE_SIZE for each command that may be in flight
 static void *nvme_dma_buffer;
 
+// State of an I/O command queued by nvme_prpl_xfer()
+struct nvme_io_req {
+    void *dma;                  /* page for the PRP list or bounce data */
+    void *bounce_buf;           /* destination of a bounced read, or NULL */
+    u16 count;
+};
+
 static void *
 zalloc_page_aligned(struct zone_s *zone, u32 size)
 {
@@ -38,6 +49,11 @@ nvme_init_queue_common(struct nvme_ctrl *ctrl, struct nvme_queue *q, u16 q_idx,
     memset(q, 0, sizeof(*q));
     q->dbl = (u32 *)((char *)ctrl->reg + 0x1000 + q_idx * ctrl->doorbell_stride);
     dprintf(3, " q %p q_idx %u dbl %p\n", q, q_idx, q->dbl);
+    if (ctrl->dbbuf_db && q_idx >= 2) {
+        /* Only I/O queues use the shadow doorbells */
+        q->dbbuf_db = (void *)ctrl->dbbuf_db + q_idx * ctrl->doorbell_stride;
+        q->dbbuf_ei = (void *)ctrl->dbbuf_ei + q_idx * ctrl->doorbell_stride;
+    }
     q->mask = length - 1;
 }
 
@@ -80,6 +96,28 @@ nvme_init_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq, u16 q_idx, u16 length)
     return 0;
 }
 
+/* Write a doorbell. With shadow doorbells the controller is only told about
+   the new value if it asked for it through the EventIdx. */
+static void
+nvme_write_doorbell(struct nvme_queue *q, u16 value)
+{
+    if (q->dbbuf_db) {
+        u16 old = *q->dbbuf_db;
+        /* Make sure the queue entries are written before the doorbell, as
+           writel() does for the MMIO doorbell */
+        barrier();
+        *q->dbbuf_db = value;
+
+        /* Make sure the shadow doorbell is written before reading EventIdx */
+        smp_mb();
+        /* Skip the MMIO write unless EventIdx lies in (old, value] */
+        u16 event_idx = *q->dbbuf_ei;
+        if ((u16)(value - event_idx - 1) >= (u16)(value - old))
+            return;
+    }
+    writel(q->dbl, value);
+}
+
 static int
 nvme_poll_cq(struct nvme_cq *cq)
 {
@@ -104,6 +142,8 @@ nvme_error_cqe(void)
     return r;
 }
 
+/* Consume the next completion queue entry. The controller isn't told about
+   it until nvme_ack_cqe() is called. */
 static struct nvme_cqe
 nvme_consume_cqe(struct nvme_sq *sq)
 {
@@ -129,14 +169,18 @@ nvme_consume_cqe(struct nvme_sq *sq)
         dprintf(4, "sq %p advanced to %u\n", sq, cqe->sq_head);
     }
 
-    /* Tell the controller that we consumed the completion. */
-    writel(cq->common.dbl, cq->head);
-
     return *cqe;
 }
 
+/* Tell the controller that we consumed the completions. */
+static void
+nvme_ack_cqe(struct nvme_cq *cq)
+{
+    nvme_write_doorbell(&cq->common, cq->head);
+}
+
 static struct nvme_cqe
-nvme_wait(struct nvme_sq *sq)
+nvme_wait_cqe(struct nvme_sq *sq)
 {
     static const unsigned nvme_timeout = 5000 /* ms */;
     u32 to = timer_calc(nvme_timeout);
@@ -152,12 +196,38 @@ nvme_wait(struct nvme_sq *sq)
     return nvme_consume_cqe(sq);
 }
 
+static struct nvme_cqe
+nvme_wait(struct nvme_sq *sq)
+{
+    struct nvme_cqe cqe = nvme_wait_cqe(sq);
+    nvme_ack_cqe(sq->cq);
+    return cqe;
+}
+
+/* Wait for count completions and acknowledge them all at once. Returns 0 if
+   all of them were successful. */
+static int
+nvme_wait_many(struct nvme_sq *sq, int count)
+{
+    int i, ret = 0;
+    for (i = 0; i < count; i++) {
+        struct nvme_cqe cqe = nvme_wait_cqe(sq);
+        if (!nvme_is_cqe_success(&cqe)) {
+            dprintf(2, "read io: %08x %08x %08x %08x\n",
+                    cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+            ret = -1;
+        }
+    }
+    nvme_ack_cqe(sq->cq);
+    return ret;
+}
+
 /* Returns the next submission queue entry (or NULL if the queue is full). It
    also fills out Command Dword 0 and clears the rest. */
 static struct nvme_sqe *
 nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data, void *data2)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full\n");
         return NULL;
     }
@@ -174,13 +244,28 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data, void *
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Call this after you've filled out an sqe that you've got from
+   nvme_get_next_sqe. The controller isn't told about it until
+   nvme_ring_sq() is called. */
 static void
-nvme_commit_sqe(struct nvme_sq *sq)
+nvme_queue_sqe(struct nvme_sq *sq)
 {
     dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
     sq->tail = (sq->tail + 1) & sq->common.mask;
-    writel(sq->common.dbl, sq->tail);
+}
+
+/* Tell the controller about all queued submission queue entries. */
+static void
+nvme_ring_sq(struct nvme_sq *sq)
+{
+    nvme_write_doorbell(&sq->common, sq->tail);
+}
+
+static void
+nvme_commit_sqe(struct nvme_sq *sq)
+{
+    nvme_queue_sqe(sq);
+    nvme_ring_sq(sq);
 }
 
 /* Perform an identify command on the admin queue and return the resulting
@@ -261,7 +346,8 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, u32 ns_idx, u8 mdts)
     }
 
     if (!nvme_dma_buffer) {
-        nvme_dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+        nvme_dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE
+                                              * NVME_MAX_INFLIGHT);
         if (!nvme_dma_buffer) {
             warn_noalloc();
             goto free_buffer;
@@ -318,6 +404,49 @@ free_buffer:
 }
 
 
+/* Set up shadow doorbell and EventIdx buffers. This has to happen before the
+   I/O queues are created. Returns 0 on success. */
+static int
+nvme_admin_dbbuf_config(struct nvme_ctrl *ctrl)
+{
+    if (4 * ctrl->doorbell_stride > NVME_PAGE_SIZE)
+        return -1;
+
+    u32 *db = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    u32 *ei = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    if (!db || !ei) {
+        warn_noalloc();
+        goto err;
+    }
+
+    struct nvme_sqe *cmd_dbbuf;
+    cmd_dbbuf = nvme_get_next_sqe(&ctrl->admin_sq,
+                                  NVME_SQE_OPC_ADMIN_DBBUF_CONFIG, NULL,
+                                  db, ei);
+    if (!cmd_dbbuf)
+        goto err;
+
+    nvme_commit_sqe(&ctrl->admin_sq);
+
+    struct nvme_cqe cqe = nvme_wait(&ctrl->admin_sq);
+
+    if (!nvme_is_cqe_success(&cqe)) {
+        dprintf(2, "doorbell buffer config failed: %08x %08x %08x %08x\n",
+                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+        goto err;
+    }
+
+    dprintf(3, "NVMe using shadow doorbells %p eventidx %p\n", db, ei);
+    ctrl->dbbuf_db = db;
+    ctrl->dbbuf_ei = ei;
+    return 0;
+
+err:
+    free(db);
+    free(ei);
+    return -1;
+}
+
 /* Release memory allocated for a completion queue */
 static void
 nvme_destroy_cq(struct nvme_cq *cq)
@@ -423,7 +552,8 @@ err:
     return -1;
 }
 
-/* Reads count sectors into buf. The buffer cannot cross page boundaries. */
+/* Queues a command to transfer count sectors. The controller isn't notified
+   until nvme_ring_sq() is called. */
 static int
 nvme_io_xfer(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
              u16 count, int write)
@@ -438,101 +568,80 @@ nvme_io_xfer(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
                                                  write ? NVME_SQE_OPC_IO_WRITE
                                                        : NVME_SQE_OPC_IO_READ,
                                                  NULL, prp1, prp2);
+    if (!io_read)
+        return -1;
     io_read->nsid = ns->ns_id;
     io_read->dword[10] = (u32)lba;
     io_read->dword[11] = (u32)(lba >> 32);
     io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
 
-    nvme_commit_sqe(&ns->ctrl->io_sq);
-
-    struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
-
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "read io: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
-
-        return -1;
-    }
+    nvme_queue_sqe(&ns->ctrl->io_sq);
 
     dprintf(5, "ns %u %s lba %llu+%u\n", ns->ns_id, write ? "write" : "read",
             lba, count);
     return count;
 }
 
-// Transfer up to one page of data using the internal dma bounce buffer
+// Transfer up to one page of data using the request's dma bounce buffer
 static int
-nvme_bounce_xfer(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
-                 int write)
+nvme_bounce_xfer(struct nvme_namespace *ns, struct nvme_io_req *req, u64 lba,
+                 void *buf, u16 count, int write)
 {
     u16 const max_blocks = NVME_PAGE_SIZE / ns->block_size;
     u16 blocks = count < max_blocks ? count : max_blocks;
 
     if (write)
-        memcpy(nvme_dma_buffer, buf, blocks * ns->block_size);
+        memcpy(req->dma, buf, blocks * ns->block_size);
+    else
+        req->bounce_buf = buf;
 
-    int res = nvme_io_xfer(ns, lba, nvme_dma_buffer, NULL, blocks, write);
-
-    if (!write && res >= 0)
-        memcpy(buf, nvme_dma_buffer, res * ns->block_size);
-
-    return res;
+    return nvme_io_xfer(ns, lba, req->dma, NULL, blocks, write);
 }
 
-#define NVME_MAX_PRPL_ENTRIES 15 /* Allows requests up to 64kb */
+/* A single PRP list page describes this many pages */
+#define NVME_MAX_PRPL_ENTRIES (NVME_PAGE_SIZE / sizeof(u64))
 
 // Transfer data using page list (if applicable)
 static int
-nvme_prpl_xfer(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
-               int write)
+nvme_prpl_xfer(struct nvme_namespace *ns, struct nvme_io_req *req, u64 lba,
+               void *buf, u16 count, int write)
 {
     u32 base = (long)buf;
-    s32 size;
-
-    if (count > ns->max_req_size)
-        count = ns->max_req_size;
 
-    size = count * ns->block_size;
-    /* Special case for transfers that fit into PRP1, but are unaligned */
-    if (((size + (base & ~NVME_PAGE_MASK)) <= NVME_PAGE_SIZE))
-        goto single;
-
-    /* Every request has to be page aligned */
-    if (base & ~NVME_PAGE_MASK)
-        goto bounce;
-
-    /* Make sure a full block fits into the last chunk */
-    if (size & (ns->block_size - 1ULL))
+    /* PRP entries have to be dword aligned */
+    if (base & 0x3)
         goto bounce;
 
-    /* Build PRP list if we need to describe more than 2 pages */
-    if ((ns->block_size * count) > (NVME_PAGE_SIZE * 2)) {
-        u32 prpl_len = 0;
-        u64 *prpl = nvme_dma_buffer;
-        int first_page = 1;
-        for (; size > 0; base += NVME_PAGE_SIZE, size -= NVME_PAGE_SIZE) {
-            if (first_page) {
-                /* First page is special */
-                first_page = 0;
-                continue;
-            }
-            if (prpl_len >= NVME_MAX_PRPL_ENTRIES)
-                goto bounce;
-            prpl[prpl_len++] = base;
-        }
-        return nvme_io_xfer(ns, lba, buf, prpl, count, write);
-    }
-
-    /* Directly embed the 2nd page if we only need 2 pages */
-    if ((ns->block_size * count) > NVME_PAGE_SIZE)
-        return nvme_io_xfer(ns, lba, buf, buf + NVME_PAGE_SIZE, count, write);
+    if (count > ns->max_req_size)
+        count = ns->max_req_size;
 
-single:
-    /* One page is enough, don't expose anything else */
-    return nvme_io_xfer(ns, lba, buf, NULL, count, write);
+    /* PRP1 describes the (possibly partial) first page, every other entry
+       starts at a page boundary. Limit the request to what PRP1 plus one
+       PRP list page can describe. */
+    u32 first = NVME_PAGE_SIZE - (base & ~NVME_PAGE_MASK);
+    u32 max_size = first + NVME_MAX_PRPL_ENTRIES * NVME_PAGE_SIZE;
+    if (count * ns->block_size > max_size)
+        count = max_size / ns->block_size;
+    u32 size = count * ns->block_size;
+
+    if (size <= first)
+        /* One page is enough, don't expose anything else */
+        return nvme_io_xfer(ns, lba, buf, NULL, count, write);
+
+    if (size <= first + NVME_PAGE_SIZE)
+        /* Directly embed the 2nd page if we only need 2 pages */
+        return nvme_io_xfer(ns, lba, buf, (void*)(base + first), count, write);
+
+    /* Build PRP list for the pages following the first one */
+    u64 *prpl = req->dma;
+    u32 prpl_len = 0, page;
+    for (page = base + first; page < base + size; page += NVME_PAGE_SIZE)
+        prpl[prpl_len++] = page;
+    return nvme_io_xfer(ns, lba, buf, prpl, count, write);
 
 bounce:
     /* Use bounce buffer to make transfer */
-    return nvme_bounce_xfer(ns, lba, buf, count, write);
+    return nvme_bounce_xfer(ns, req, lba, buf, count, write);
 }
 
 static int
@@ -638,8 +747,12 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
 
     ctrl->ns_count = identify->nn;
     u8 mdts = identify->mdts;
+    u16 oacs = identify->oacs;
     free(identify);
 
+    if (oacs & NVME_CTRL_OACS_DBBUF)
+        nvme_admin_dbbuf_config(ctrl);
+
     if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
         /* No point to continue, if the controller says it doesn't have
            namespaces or we couldn't create I/O queues. */
@@ -734,18 +847,49 @@ nvme_scan(void)
 static int
 nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
 {
-    int i;
-    for (i = 0; i < op->count;) {
-        u16 blocks_remaining = op->count - i;
-        char *op_buf = op->buf_fl + i * ns->block_size;
-        int blocks = nvme_prpl_xfer(ns, op->lba + i, op_buf,
-                                    blocks_remaining, write);
-        if (blocks < 0)
-            return DISK_RET_EBADTRACK;
-        i += blocks;
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
+    struct nvme_io_req reqs[NVME_MAX_INFLIGHT];
+    int max_inflight = NVME_MAX_INFLIGHT;
+    if (max_inflight > sq->common.mask)
+        max_inflight = sq->common.mask;
+
+    int i, ret = DISK_RET_SUCCESS;
+    for (i = 0; i < op->count && ret == DISK_RET_SUCCESS;) {
+        /* Queue several commands and notify the controller once */
+        int n, queued;
+        for (queued = 0; queued < max_inflight && i < op->count; queued++) {
+            struct nvme_io_req *req = &reqs[queued];
+            req->dma = nvme_dma_buffer + queued * NVME_PAGE_SIZE;
+            req->bounce_buf = NULL;
+
+            u16 blocks_remaining = op->count - i;
+            char *op_buf = op->buf_fl + i * ns->block_size;
+            int blocks = nvme_prpl_xfer(ns, req, op->lba + i, op_buf,
+                                        blocks_remaining, write);
+            if (blocks < 0) {
+                ret = DISK_RET_EBADTRACK;
+                break;
+            }
+            req->count = blocks;
+            i += blocks;
+        }
+        if (!queued)
+            break;
+
+        nvme_ring_sq(sq);
+        if (nvme_wait_many(sq, queued)) {
+            ret = DISK_RET_EBADTRACK;
+            break;
+        }
+
+        for (n = 0; n < queued; n++) {
+            struct nvme_io_req *req = &reqs[n];
+            if (req->bounce_buf)
+                memcpy(req->bounce_buf, req->dma, req->count * ns->block_size);
+        }
     }
 
-    return DISK_RET_SUCCESS;
+    return ret;
 }
 
 int
@@ -27,6 +27,14 @@
 
 #define SIMPLE_QUEUE_TAG 0x20
 
+// Maximum number of ring entries used by a single disk_op
+#define PVSCSI_MAX_INFLIGHT 8
+// Number of targets probed at once
+#define PVSCSI_SCAN_THREADS 8
+
+// Host status of a command sent to a target that doesn't exist
+#define BTSTAT_SELTIMEO 0x11
+
 #define PVSCSI_INTR_CMPL_0                 (1 << 0)
 #define PVSCSI_INTR_CMPL_1                 (1 << 1)
 #define PVSCSI_INTR_CMPL_MASK              MASK(2)
@@ -154,14 +162,6 @@ pvscsi_kick_rw_io(void *iobase)
     writel(iobase + PVSCSI_REG_OFFSET_KICK_RW_IO, 0);
 }
 
-static void
-pvscsi_wait_intr_cmpl(void *iobase)
-{
-    while (!(readl(iobase + PVSCSI_REG_OFFSET_INTR_STATUS) & PVSCSI_INTR_CMPL_MASK))
-        usleep(5);
-    writel(iobase + PVSCSI_REG_OFFSET_INTR_STATUS, PVSCSI_INTR_CMPL_MASK);
-}
-
 static void
 pvscsi_init_rings(void *iobase, struct pvscsi_ring_dsc_s **ring_dsc)
 {
@@ -198,62 +198,112 @@ pvscsi_init_rings(void *iobase, struct pvscsi_ring_dsc_s **ring_dsc)
     *ring_dsc = dsc;
 }
 
-static u32
+// Completion status of a request, found through the request context
+struct pvscsi_cmpl_s {
+    u16 hostStatus;
+    u16 scsiStatus;
+    u8 done;
+};
+
+static void
 pvscsi_get_rsp(struct PVSCSIRingsState *s,
                struct PVSCSIRingCmpDesc *rsp)
 {
-    u32 status = rsp->hostStatus;
+    struct pvscsi_cmpl_s *cmpl = (void*)(u32)rsp->context;
+    cmpl->hostStatus = rsp->hostStatus;
+    cmpl->scsiStatus = rsp->scsiStatus;
+    cmpl->done = 1;
     s->cmpConsIdx = s->cmpConsIdx + 1;
-    return status;
 }
 
-int
-pvscsi_process_op(struct disk_op_s *op)
+// Reap one completion if there is any.  Threads scanning targets share
+// the rings, so a completion may belong to another thread's request.
+static int
+pvscsi_reap(struct pvscsi_ring_dsc_s *ring_dsc)
 {
-    if (!CONFIG_PVSCSI)
-        return DISK_RET_EBADTRACK;
-    struct pvscsi_lun_s *plun =
-        container_of(op->drive_fl, struct pvscsi_lun_s, drive);
-    struct pvscsi_ring_dsc_s *ring_dsc = plun->ring_dsc;
     struct PVSCSIRingsState *s = ring_dsc->ring_state;
-    u32 req_entries = s->reqNumEntriesLog2;
+    if (s->cmpConsIdx == s->cmpProdIdx)
+        return 0;
     u32 cmp_entries = s->cmpNumEntriesLog2;
-    struct PVSCSIRingReqDesc *req;
-    struct PVSCSIRingCmpDesc *rsp;
-    u32 status;
-
-    if (s->reqProdIdx - s->cmpConsIdx >= 1 << req_entries) {
-        dprintf(1, "pvscsi: ring full: reqProdIdx=%d cmpConsIdx=%d\n",
-                s->reqProdIdx, s->cmpConsIdx);
-        return DISK_RET_EBADTRACK;
-    }
+    pvscsi_get_rsp(s, ring_dsc->ring_cmps + (s->cmpConsIdx & MASK(cmp_entries)));
+    return 1;
+}
 
-    req = ring_dsc->ring_reqs + (s->reqProdIdx & MASK(req_entries));
-    int blocksize = scsi_fill_cmd(op, req->cdb, 16);
-    if (blocksize < 0)
-        return default_process_op(op);
-    req->bus = 0;
-    req->target = plun->target;
-    memset(req->lun, 0, sizeof(req->lun));
-    req->lun[1] = plun->lun;
-    req->senseLen = 0;
-    req->senseAddr = 0;
-    req->cdbLen = 16;
-    req->vcpuHint = 0;
-    req->tag = SIMPLE_QUEUE_TAG;
-    req->flags = scsi_is_read(op) ?
-        PVSCSI_FLAG_CMD_DIR_TOHOST : PVSCSI_FLAG_CMD_DIR_TODEVICE;
-    req->dataLen = op->count * blocksize;
-    req->dataAddr = (u32)op->buf_fl;
-    s->reqProdIdx = s->reqProdIdx + 1;
+// Send @op to @plun.  The host status of a failed request is stored in
+// @hostStatus.
+static int
+pvscsi_cmd(struct pvscsi_lun_s *plun, struct disk_op_s *op, u16 *hostStatus)
+{
+    struct pvscsi_ring_dsc_s *ring_dsc = plun->ring_dsc;
+    struct PVSCSIRingsState *s = ring_dsc->ring_state;
+    u32 req_entries = s->reqNumEntriesLog2;
 
+    // Split large reads and writes over several ring entries
+    struct disk_op_s subop;
+    int nreqs = scsi_split_init(op, &subop, PVSCSI_MAX_INFLIGHT);
+
+    // Wait for room for all entries, so another thread can't kick the
+    // device while only part of them are on the ring
+    while (s->reqProdIdx - s->cmpConsIdx + nreqs > 1 << req_entries)
+        if (!pvscsi_reap(ring_dsc))
+            yield();
+
+    struct pvscsi_cmpl_s cmpl[PVSCSI_MAX_INFLIGHT];
+    int num_added = 0, blocksize;
+    do {
+        struct PVSCSIRingReqDesc *req =
+            ring_dsc->ring_reqs + (s->reqProdIdx & MASK(req_entries));
+        blocksize = scsi_fill_cmd(&subop, req->cdb, 16);
+        if (blocksize < 0)
+            return default_process_op(op);
+        cmpl[num_added].done = 0;
+        req->context = (u32)&cmpl[num_added];
+        req->bus = 0;
+        req->target = plun->target;
+        memset(req->lun, 0, sizeof(req->lun));
+        req->lun[1] = plun->lun;
+        req->senseLen = 0;
+        req->senseAddr = 0;
+        req->cdbLen = 16;
+        req->vcpuHint = 0;
+        req->tag = SIMPLE_QUEUE_TAG;
+        req->flags = scsi_is_read(op) ?
+            PVSCSI_FLAG_CMD_DIR_TOHOST : PVSCSI_FLAG_CMD_DIR_TODEVICE;
+        req->dataLen = subop.count * blocksize;
+        req->dataAddr = (u32)subop.buf_fl;
+        s->reqProdIdx = s->reqProdIdx + 1;
+        num_added++;
+    } while (scsi_split_next(op, &subop, PVSCSI_MAX_INFLIGHT, blocksize));
+
+    // A single kick makes the device process every queued entry
     pvscsi_kick_rw_io(plun->iobase);
-    pvscsi_wait_intr_cmpl(plun->iobase);
 
-    rsp = ring_dsc->ring_cmps + (s->cmpConsIdx & MASK(cmp_entries));
-    status = pvscsi_get_rsp(s, rsp);
+    int i, ret = DISK_RET_SUCCESS;
+    *hostStatus = 0;
+    for (i = 0; i < num_added; i++) {
+        while (!cmpl[i].done)
+            if (!pvscsi_reap(ring_dsc))
+                yield();
+        // A CHECK CONDITION is reported with a good host status
+        if (cmpl[i].hostStatus || cmpl[i].scsiStatus) {
+            if (!*hostStatus)
+                *hostStatus = cmpl[i].hostStatus;
+            ret = DISK_RET_EBADTRACK;
+        }
+    }
+    writel(plun->iobase + PVSCSI_REG_OFFSET_INTR_STATUS, PVSCSI_INTR_CMPL_MASK);
+    return ret;
+}
 
-    return status == 0 ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+int
+pvscsi_process_op(struct disk_op_s *op)
+{
+    if (!CONFIG_PVSCSI)
+        return DISK_RET_EBADTRACK;
+    struct pvscsi_lun_s *plun =
+        container_of(op->drive_fl, struct pvscsi_lun_s, drive);
+    u16 hostStatus;
+    return pvscsi_cmd(plun, op, &hostStatus);
 }
 
 static int
@@ -287,12 +337,42 @@ fail:
     return -1;
 }
 
-static void
-pvscsi_scan_target(struct pci_device *pci, void *iobase,
-                   struct pvscsi_ring_dsc_s *ring_dsc, u8 target)
+struct pvscsi_hba_s {
+    struct pci_device *pci;
+    void *iobase;
+    struct pvscsi_ring_dsc_s *ring_dsc;
+};
+
+static int
+pvscsi_scan_target(void *data, u32 target)
 {
+    struct pvscsi_hba_s *hba = data;
+
+    /* Skip targets that time out on selection without setting up a
+     * drive for them */
+    struct pvscsi_lun_s plun0;
+    memset(&plun0, 0, sizeof(plun0));
+    plun0.drive.type = DTYPE_PVSCSI;
+    plun0.drive.cntl_id = hba->pci->bdf;
+    plun0.target = target;
+    plun0.iobase = hba->iobase;
+    plun0.ring_dsc = hba->ring_dsc;
+
+    u8 cdb[16];
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = CDB_CMD_TEST_UNIT_READY;
+    struct disk_op_s op;
+    memset(&op, 0, sizeof(op));
+    op.drive_fl = &plun0.drive;
+    op.command = CMD_SCSI;
+    op.cdbcmd = cdb;
+    u16 hostStatus;
+    pvscsi_cmd(&plun0, &op, &hostStatus);
+    if (hostStatus == BTSTAT_SELTIMEO)
+        return 0;
+
     /* pvscsi has no more than a single lun per target */
-    pvscsi_add_lun(pci, iobase, ring_dsc, target, 0);
+    return !pvscsi_add_lun(hba->pci, hba->iobase, hba->ring_dsc, target, 0);
 }
 
 static void
@@ -310,9 +390,13 @@ init_pvscsi(void *data)
 
     struct pvscsi_ring_dsc_s *ring_dsc = NULL;
     pvscsi_init_rings(iobase, &ring_dsc);
-    int i;
-    for (i = 0; i < 64; i++)
-        pvscsi_scan_target(pci, iobase, ring_dsc, i);
+
+    struct pvscsi_hba_s hba = {
+        .pci = pci,
+        .iobase = iobase,
+        .ring_dsc = ring_dsc,
+    };
+    scsi_scan_targets(&hba, 64, PVSCSI_SCAN_THREADS, pvscsi_scan_target);
 }
 
 void
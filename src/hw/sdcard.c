@@ -66,20 +66,26 @@ struct sdhci_s {
 #define SC_SEND_OP_COND         ((1<<8) | SCB_R48o)
 #define SC_ALL_SEND_CID         ((2<<8) | SCB_R136)
 #define SC_SEND_RELATIVE_ADDR   ((3<<8) | SCB_R48)
+#define SC_SWITCH_FUNC          ((6<<8) | SCB_R48d)
+#define SC_SWITCH               ((6<<8) | SCB_R48b)
 #define SC_SELECT_DESELECT_CARD ((7<<8) | SCB_R48b)
 #define SC_SEND_IF_COND         ((8<<8) | SCB_R48)
 #define SC_SEND_EXT_CSD         ((8<<8) | SCB_R48d)
 #define SC_SEND_CSD             ((9<<8) | SCB_R136)
+#define SC_SEND_STATUS          ((13<<8) | SCB_R48)
 #define SC_READ_SINGLE          ((17<<8) | SCB_R48d)
 #define SC_READ_MULTIPLE        ((18<<8) | SCB_R48d)
 #define SC_WRITE_SINGLE         ((24<<8) | SCB_R48d)
 #define SC_WRITE_MULTIPLE       ((25<<8) | SCB_R48d)
 #define SC_APP_CMD              ((55<<8) | SCB_R48)
+#define SC_APP_SET_BUS_WIDTH    ((6<<8) | SCB_R48)
+#define SC_APP_SD_STATUS        ((13<<8) | SCB_R48d)
 #define SC_APP_SEND_OP_COND ((41<<8) | SCB_R48o)
 
 // SDHCI irqs
 #define SI_CMD_COMPLETE (1<<0)
 #define SI_TRANS_DONE   (1<<1)
+#define SI_DMA          (1<<3)
 #define SI_WRITE_READY  (1<<4)
 #define SI_READ_READY   (1<<5)
 #define SI_ERROR        (1<<15)
@@ -90,12 +96,28 @@ struct sdhci_s {
 #define SP_CARD_INSERTED (1<<16)
 
 // SDHCI transfer_mode flags
+#define ST_DMA        (1<<0)
 #define ST_BLOCKCOUNT (1<<1)
 #define ST_AUTO_CMD12 (1<<2)
 #define ST_READ       (1<<4)
 #define ST_MULTIPLE   (1<<5)
 
+// SDHCI block_size flags
+#define SB_SDMA_BOUNDARY_512K (7<<12)
+
+// SDHCI host_control flags
+#define SHC_4BIT       (1<<1)
+#define SHC_HISPEED    (1<<2)
+#define SHC_8BIT       (1<<5)
+#define SHC_DMA_MASK   (3<<3)
+#define SHC_DMA_SDMA   (0<<3)
+#define SHC_DMA_ADMA32 (2<<3)
+
 // SDHCI capabilities flags
+#define SD_CAPLO_8BIT            (1<<18)
+#define SD_CAPLO_ADMA2           (1<<19)
+#define SD_CAPLO_HISPEED         (1<<21)
+#define SD_CAPLO_SDMA            (1<<22)
 #define SD_CAPLO_V33             (1<<24)
 #define SD_CAPLO_V30             (1<<25)
 #define SD_CAPLO_V18             (1<<26)
@@ -125,6 +147,18 @@ struct sdhci_s {
 // SDHCI result flags
 #define SR_OCR_CCS     (1<<30)
 #define SR_OCR_NOTBUSY (1<<31)
+#define SR_SWITCH_ERR  (1<<7)
+#define SR_READY       (1<<8)
+#define SR_STATE_SHIFT 9
+#define SR_STATE_MASK  0x0f
+#define SR_STATE_TRAN  4
+
+// MMC EXT_CSD fields
+#define EXT_CSD_BUS_WIDTH  183
+#define EXT_CSD_HS_TIMING  185
+#define EXT_CSD_CARD_TYPE  196
+#define EXT_CSD_SEC_COUNT  212
+#define ECT_HS_52          (1<<1)
 
 // SDHCI timeouts
 #define SDHCI_POWER_OFF_TIME   1
@@ -133,13 +167,44 @@ struct sdhci_s {
 #define SDHCI_POWERUP_TIMEOUT  1000
 #define SDHCI_PIO_TIMEOUT      1000  // XXX - this is just made up
 
+// SDHCI clock rates (in khz)
+#define SDHCI_FREQ_INIT        400
+#define SDHCI_FREQ_DEFAULT     25000
+#define SDHCI_FREQ_SD_HS       50000
+#define SDHCI_FREQ_MMC_HS      52000
+
+// SDHCI ADMA2 descriptor (32bit addressing)
+struct sdhci_adma_desc {
+    u16 attr;
+    u16 length;
+    u32 addr;
+} PACKED;
+
+// SDHCI ADMA2 descriptor attributes
+#define SAD_VALID (1<<0)
+#define SAD_END   (1<<1)
+#define SAD_TRAN  (2<<4)
+
+// Largest transfer described by one ADMA2 descriptor
+#define SDHCI_ADMA_MAXLEN (32*1024)
+// Enough descriptors for the largest (1MB read-ahead) block request
+#define SDHCI_ADMA_DESCS  (1024*1024 / SDHCI_ADMA_MAXLEN)
+
 // Internal 'struct drive_s' storage for a detected card
 struct sddrive_s {
     struct drive_s drive;
     struct sdhci_s *regs;
     int card_type;
+    u16 rca;
+    int dma_mode;
+    struct sdhci_adma_desc *adma;
 };
 
+// SD dma modes
+#define SDM_PIO   0
+#define SDM_SDMA  1
+#define SDM_ADMA2 2
+
 // SD card types
 #define SF_MMC          (1<<0)
 #define SF_HIGHCAPACITY (1<<1)
@@ -210,54 +275,140 @@ sdcard_pio(struct sdhci_s *regs, int cmd, u32 *param)
 
 // Send an "app specific" command to the card.
 static int
-sdcard_pio_app(struct sdhci_s *regs, int cmd, u32 *param)
+sdcard_pio_app(struct sdhci_s *regs, u16 rca, int cmd, u32 *param)
 {
-    u32 aparam[4] = {};
+    u32 aparam[4] = { rca << 16 };
     int ret = sdcard_pio(regs, SC_APP_CMD, aparam);
     if (ret)
         return ret;
     return sdcard_pio(regs, cmd, param);
 }
 
-// Send a command to the card which transfers data.
+// Send a command with a raw argument which transfers data blocks.
 static int
-sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
-                    , void *data, int count)
+sdcard_pio_data(struct sdhci_s *regs, int cmd, u32 arg
+                , void *data, int blocksize, int count)
 {
     // Send command
-    writew(&drive->regs->block_size, DISK_SECTOR_SIZE);
-    writew(&drive->regs->block_count, count);
+    writew(&regs->block_size, blocksize);
+    writew(&regs->block_count, count);
     int isread = cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE;
     u16 tmode = ((count > 1 ? ST_MULTIPLE|ST_AUTO_CMD12|ST_BLOCKCOUNT : 0)
                  | (isread ? ST_READ : 0));
-    writew(&drive->regs->transfer_mode, tmode);
-    if (!(drive->card_type & SF_HIGHCAPACITY))
-        addr *= DISK_SECTOR_SIZE;
-    u32 param[4] = { addr };
-    int ret = sdcard_pio(drive->regs, cmd, param);
+    writew(&regs->transfer_mode, tmode);
+    u32 param[4] = { arg };
+    int ret = sdcard_pio(regs, cmd, param);
     if (ret)
         return ret;
     // Read/write data
     u16 cbit = isread ? SI_READ_READY : SI_WRITE_READY;
     while (count--) {
-        ret = sdcard_waitw(&drive->regs->irq_status, cbit);
+        ret = sdcard_waitw(&regs->irq_status, cbit|SI_ERROR);
         if (ret < 0)
             return ret;
-        writew(&drive->regs->irq_status, cbit);
+        if (ret & SI_ERROR)
+            goto fail;
+        writew(&regs->irq_status, cbit);
         int i;
-        for (i=0; i<DISK_SECTOR_SIZE/4; i++) {
+        for (i=0; i<blocksize/4; i++) {
             if (isread)
-                *(u32*)data = readl(&drive->regs->data);
+                *(u32*)data = readl(&regs->data);
             else
-                writel(&drive->regs->data, *(u32*)data);
+                writel(&regs->data, *(u32*)data);
             data += 4;
         }
     }
     // Complete command
-    ret = sdcard_waitw(&drive->regs->irq_status, SI_TRANS_DONE);
+    ret = sdcard_waitw(&regs->irq_status, SI_TRANS_DONE|SI_ERROR);
     if (ret < 0)
         return ret;
-    writew(&drive->regs->irq_status, SI_TRANS_DONE);
+    if (ret & SI_ERROR)
+        goto fail;
+    writew(&regs->irq_status, SI_TRANS_DONE);
+    return 0;
+fail: ;
+    // Data crc or timeout error
+    u16 err = readw(&regs->error_irq_status);
+    dprintf(3, "sdcard_pio_data stop (code=%x)\n", err);
+    sdcard_reset(regs, SRF_CMD|SRF_DATA);
+    writew(&regs->error_irq_status, err);
+    return -1;
+}
+
+// Send a command to the card which transfers data.
+static int
+sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
+                    , void *data, int count)
+{
+    if (!(drive->card_type & SF_HIGHCAPACITY))
+        addr *= DISK_SECTOR_SIZE;
+    return sdcard_pio_data(drive->regs, cmd, addr, data
+                           , DISK_SECTOR_SIZE, count);
+}
+
+// Send a command to the card which transfers data using SDMA or ADMA2.
+static int
+sdcard_dma_transfer(struct sddrive_s *drive, int cmd, u32 addr
+                    , void *data, int count)
+{
+    struct sdhci_s *regs = drive->regs;
+    u16 bsize = DISK_SECTOR_SIZE;
+    if (drive->dma_mode == SDM_ADMA2) {
+        // Build descriptor table
+        struct sdhci_adma_desc *desc = drive->adma;
+        u32 pos = (u32)data, len = count * DISK_SECTOR_SIZE;
+        for (;;) {
+            u32 dlen = len > SDHCI_ADMA_MAXLEN ? SDHCI_ADMA_MAXLEN : len;
+            desc->addr = pos;
+            desc->length = dlen;
+            len -= dlen;
+            pos += dlen;
+            desc->attr = SAD_TRAN | SAD_VALID | (len ? 0 : SAD_END);
+            if (!len)
+                break;
+            desc++;
+        }
+        barrier();
+        writel(&regs->adma_addr, (u32)drive->adma);
+        writel((void*)&regs->adma_addr + 4, 0);
+    } else {
+        writel(&regs->sdma_addr, (u32)data);
+        bsize |= SB_SDMA_BOUNDARY_512K;
+    }
+    // Send command
+    writew(&regs->irq_status, SI_TRANS_DONE|SI_DMA);
+    writew(&regs->block_size, bsize);
+    writew(&regs->block_count, count);
+    int isread = cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE;
+    u16 tmode = ((count > 1 ? ST_MULTIPLE|ST_AUTO_CMD12|ST_BLOCKCOUNT : 0)
+                 | (isread ? ST_READ : 0) | ST_DMA);
+    writew(&regs->transfer_mode, tmode);
+    if (!(drive->card_type & SF_HIGHCAPACITY))
+        addr *= DISK_SECTOR_SIZE;
+    u32 param[4] = { addr };
+    int ret = sdcard_pio(regs, cmd, param);
+    if (ret)
+        return ret;
+    // Wait for completion
+    for (;;) {
+        ret = sdcard_waitw(&regs->irq_status, SI_TRANS_DONE|SI_DMA|SI_ERROR);
+        if (ret < 0)
+            return ret;
+        if (ret & SI_ERROR) {
+            u16 err = readw(&regs->error_irq_status);
+            dprintf(3, "sdcard_dma_transfer stop (code=%x adma=%x)\n"
+                    , err, readb(&regs->adma_error));
+            sdcard_reset(regs, SRF_CMD|SRF_DATA);
+            writew(&regs->error_irq_status, err);
+            return -1;
+        }
+        if (ret & SI_TRANS_DONE)
+            break;
+        // SDMA stopped at a buffer boundary - restart at next address
+        writew(&regs->irq_status, SI_DMA);
+        writel(&regs->sdma_addr, readl(&regs->sdma_addr));
+    }
+    writew(&regs->irq_status, SI_TRANS_DONE|SI_DMA);
     return 0;
 }
 
@@ -270,7 +421,14 @@ sdcard_readwrite(struct disk_op_s *op, int iswrite)
     int cmd = iswrite ? SC_WRITE_SINGLE : SC_READ_SINGLE;
     if (op->count > 1)
         cmd = iswrite ? SC_WRITE_MULTIPLE : SC_READ_MULTIPLE;
-    int ret = sdcard_pio_transfer(drive, cmd, op->lba, op->buf_fl, op->count);
+    int ret;
+    if (drive->dma_mode == SDM_SDMA
+        || (drive->dma_mode == SDM_ADMA2 && !((u32)op->buf_fl & 0x03)
+            && op->count * DISK_SECTOR_SIZE
+               <= SDHCI_ADMA_DESCS * SDHCI_ADMA_MAXLEN))
+        ret = sdcard_dma_transfer(drive, cmd, op->lba, op->buf_fl, op->count);
+    else
+        ret = sdcard_pio_transfer(drive, cmd, op->lba, op->buf_fl, op->count);
     if (ret)
         return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
@@ -321,6 +479,32 @@ sdcard_set_power(struct sdhci_s *regs)
     return volt;
 }
 
+// Select the DMA engine to use for data transfers
+static void
+sdcard_set_dma(struct sddrive_s *drive)
+{
+    struct sdhci_s *regs = drive->regs;
+    u16 ver = readw(&regs->controller_version);
+    u32 cap = readl(&regs->cap_lo);
+    u8 hctl = readb(&regs->host_control) & ~SHC_DMA_MASK;
+    if ((ver & 0xff) >= 0x01 && cap & SD_CAPLO_ADMA2) {
+        drive->adma = memalign_high(
+            8, sizeof(*drive->adma) * SDHCI_ADMA_DESCS);
+        if (drive->adma) {
+            drive->dma_mode = SDM_ADMA2;
+            drive->drive.max_sectors = (SDHCI_ADMA_DESCS * SDHCI_ADMA_MAXLEN
+                                        / DISK_SECTOR_SIZE);
+            writeb(&regs->host_control, hctl | SHC_DMA_ADMA32);
+            return;
+        }
+        warn_noalloc();
+    }
+    if (cap & SD_CAPLO_SDMA) {
+        drive->dma_mode = SDM_SDMA;
+        writeb(&regs->host_control, hctl | SHC_DMA_SDMA);
+    }
+}
+
 static int
 sdcard_set_frequency(struct sdhci_s *regs, u32 khz)
 {
@@ -338,7 +522,7 @@ sdcard_set_frequency(struct sdhci_s *regs, u32 khz)
         divisor = divisor > 1 ? 1 << __fls(divisor-1) : 0;
         creg = (divisor & SCC_SDCLK_MASK) << SCC_SDCLK_SHIFT;
     } else {
-        divisor = DIV_ROUND_UP(divisor, 2);
+        divisor = divisor > 1 ? DIV_ROUND_UP(divisor, 2) : 0;
         creg = (divisor & SCC_SDCLK_MASK) << SCC_SDCLK_SHIFT;
         creg |= (divisor & SCC_SDCLK_HI_MASK) >> SCC_SDCLK_HI_RSHIFT;
     }
@@ -383,13 +567,170 @@ sdcard_get_capacity(struct sddrive_s *drive, u8 *csd)
     return 0;
 }
 
+// Update the bus width and timing bits of the host control register
+static void
+sdcard_set_hostctl(struct sdhci_s *regs, u8 mask, u8 bits)
+{
+    writeb(&regs->host_control, (readb(&regs->host_control) & ~mask) | bits);
+}
+
+// Wait for the card to return to the transfer state
+static int
+sdcard_wait_ready(struct sddrive_s *drive)
+{
+    u32 end = timer_calc(SDHCI_PIO_TIMEOUT);
+    for (;;) {
+        u32 param[4] = { drive->rca << 16 };
+        int ret = sdcard_pio(drive->regs, SC_SEND_STATUS, param);
+        if (ret)
+            return ret;
+        if (param[0] & SR_SWITCH_ERR)
+            return -1;
+        if (param[0] & SR_READY
+            && ((param[0] >> SR_STATE_SHIFT) & SR_STATE_MASK) == SR_STATE_TRAN)
+            return 0;
+        if (timer_check(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
+}
+
+// Write a byte of the MMC EXT_CSD register
+static int
+sdcard_mmc_switch(struct sddrive_s *drive, u8 index, u8 value)
+{
+    u32 param[4] = { (3<<24) | (index<<16) | (value<<8) };
+    int ret = sdcard_pio(drive->regs, SC_SWITCH, param);
+    if (ret)
+        return ret;
+    return sdcard_wait_ready(drive);
+}
+
+// Read data over the data lines to confirm the bus works at new settings.
+// For MMC cards the EXT_CSD register is read again into 'ext_csd' and
+// its sector count compared with 'sec_count'.
+static int
+sdcard_verify_bus(struct sddrive_s *drive, u8 *ext_csd, u32 sec_count)
+{
+    struct sdhci_s *regs = drive->regs;
+    if (!(drive->card_type & SF_MMC)) {
+        u8 status[64];
+        u32 param[4] = { drive->rca << 16 };
+        int ret = sdcard_pio(regs, SC_APP_CMD, param);
+        if (ret)
+            return ret;
+        return sdcard_pio_data(regs, SC_APP_SD_STATUS, 0, status
+                               , sizeof(status), 1);
+    }
+    int ret = sdcard_pio_data(regs, SC_SEND_EXT_CSD, 0, ext_csd, 512, 1);
+    if (ret)
+        return ret;
+    if (*(u32*)&ext_csd[EXT_CSD_SEC_COUNT] != sec_count)
+        return -1;
+    return 0;
+}
+
+// Switch an SD card to a 4bit bus and high speed timing
+static void
+sdcard_sd_set_bus(struct sddrive_s *drive)
+{
+    struct sdhci_s *regs = drive->regs;
+    u32 param[4] = { 2 };
+    int ret = sdcard_pio_app(regs, drive->rca, SC_APP_SET_BUS_WIDTH, param);
+    if (ret)
+        return;
+    sdcard_set_hostctl(regs, SHC_4BIT|SHC_8BIT, SHC_4BIT);
+    if (sdcard_verify_bus(drive, NULL, 0)) {
+        dprintf(1, "sdcard %p: 4bit bus failed - using 1bit bus\n", regs);
+        sdcard_set_hostctl(regs, SHC_4BIT|SHC_8BIT, 0);
+        param[0] = 0;
+        sdcard_pio_app(regs, drive->rca, SC_APP_SET_BUS_WIDTH, param);
+        return;
+    }
+
+    if (!(readl(&regs->cap_lo) & SD_CAPLO_HISPEED))
+        return;
+    // Check for and then select high speed in function group 1
+    u8 sw[64];
+    ret = sdcard_pio_data(regs, SC_SWITCH_FUNC, 0x00fffff1, sw, sizeof(sw), 1);
+    if (ret || !(sw[13] & 0x02))
+        return;
+    ret = sdcard_pio_data(regs, SC_SWITCH_FUNC, 0x80fffff1, sw, sizeof(sw), 1);
+    if (ret || (sw[16] & 0x0f) != 0x01)
+        return;
+    sdcard_set_hostctl(regs, SHC_HISPEED, SHC_HISPEED);
+    ret = sdcard_set_frequency(regs, SDHCI_FREQ_SD_HS);
+    if (!ret && !sdcard_verify_bus(drive, NULL, 0))
+        return;
+    dprintf(1, "sdcard %p: high speed failed - using default speed\n", regs);
+    sdcard_set_hostctl(regs, SHC_HISPEED, 0);
+    sdcard_set_frequency(regs, SDHCI_FREQ_DEFAULT);
+    sdcard_pio_data(regs, SC_SWITCH_FUNC, 0x80fffff0, sw, sizeof(sw), 1);
+}
+
+// Switch an MMC card to the widest bus and high speed timing
+static void
+sdcard_mmc_set_bus(struct sddrive_s *drive, u8 *csd)
+{
+    struct sdhci_s *regs = drive->regs;
+    u8 SPEC_VERS = (csd[14] >> 2) & 0x0f;
+    if (SPEC_VERS < 4)
+        // No EXT_CSD register
+        return;
+    // One buffer holds the EXT_CSD register and each re-read of it
+    u8 *ext_csd = malloc_tmp(512);
+    if (!ext_csd) {
+        warn_noalloc();
+        return;
+    }
+    int ret = sdcard_pio_data(regs, SC_SEND_EXT_CSD, 0, ext_csd, 512, 1);
+    if (ret)
+        goto done;
+    u32 sec_count = *(u32*)&ext_csd[EXT_CSD_SEC_COUNT];
+    u8 card_type = ext_csd[EXT_CSD_CARD_TYPE];
+    u32 cap = readl(&regs->cap_lo);
+
+    // Try an 8bit bus (if the controller has one) then a 4bit bus
+    int width;
+    for (width = (cap & SD_CAPLO_8BIT) ? 2 : 1; width; width--) {
+        ret = sdcard_mmc_switch(drive, EXT_CSD_BUS_WIDTH, width);
+        if (ret)
+            continue;
+        sdcard_set_hostctl(regs, SHC_4BIT|SHC_8BIT
+                           , width == 2 ? SHC_8BIT : SHC_4BIT);
+        if (!sdcard_verify_bus(drive, ext_csd, sec_count))
+            break;
+        dprintf(1, "sdcard %p: %dbit bus failed\n", regs, 4 << (width-1));
+        sdcard_set_hostctl(regs, SHC_4BIT|SHC_8BIT, 0);
+        sdcard_mmc_switch(drive, EXT_CSD_BUS_WIDTH, 0);
+    }
+
+    if (!(cap & SD_CAPLO_HISPEED) || !(card_type & ECT_HS_52))
+        goto done;
+    ret = sdcard_mmc_switch(drive, EXT_CSD_HS_TIMING, 1);
+    if (ret)
+        goto done;
+    sdcard_set_hostctl(regs, SHC_HISPEED, SHC_HISPEED);
+    ret = sdcard_set_frequency(regs, SDHCI_FREQ_MMC_HS);
+    if (!ret && !sdcard_verify_bus(drive, ext_csd, sec_count))
+        goto done;
+    dprintf(1, "sdcard %p: high speed failed - using default speed\n", regs);
+    sdcard_set_hostctl(regs, SHC_HISPEED, 0);
+    sdcard_set_frequency(regs, SDHCI_FREQ_DEFAULT);
+    sdcard_mmc_switch(drive, EXT_CSD_HS_TIMING, 0);
+done:
+    free(ext_csd);
+}
+
 // Initialize an SD card
 static int
 sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
 {
     struct sdhci_s *regs = drive->regs;
     // Set controller to initialization clock rate
-    int ret = sdcard_set_frequency(regs, 400);
+    int ret = sdcard_set_frequency(regs, SDHCI_FREQ_INIT);
     if (ret)
         return ret;
     msleep(SDHCI_CLOCK_ON_TIME);
@@ -406,7 +747,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         hcs = (1<<30);
     // Verify SD card (instead of MMC or SDIO)
     param[0] = 0x00;
-    ret = sdcard_pio_app(regs, SC_APP_SEND_OP_COND, param);
+    ret = sdcard_pio_app(regs, 0, SC_APP_SEND_OP_COND, param);
     if (ret) {
         // Check for MMC card
         param[0] = 0x00;
@@ -423,7 +764,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         if (drive->card_type & SF_MMC)
             ret = sdcard_pio(regs, SC_SEND_OP_COND, param);
         else
-            ret = sdcard_pio_app(regs, SC_APP_SEND_OP_COND, param);
+            ret = sdcard_pio_app(regs, 0, SC_APP_SEND_OP_COND, param);
         if (ret)
             return ret;
         if (param[0] & SR_OCR_NOTBUSY)
@@ -453,18 +794,26 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         return ret;
     u8 csd[16];
     memcpy(csd, param, sizeof(csd));
+    drive->rca = rca;
     param[0] = rca << 16;
     ret = sdcard_pio(regs, SC_SELECT_DESELECT_CARD, param);
     if (ret)
         return ret;
     // Set controller to data transfer clock rate
-    ret = sdcard_set_frequency(regs, 25000);
+    ret = sdcard_set_frequency(regs, SDHCI_FREQ_DEFAULT);
     if (ret)
         return ret;
     // Register drive
     ret = sdcard_get_capacity(drive, csd);
     if (ret)
         return ret;
+    if (drive->card_type & SF_MMC)
+        sdcard_mmc_set_bus(drive, csd);
+    else
+        sdcard_sd_set_bus(drive);
+    sdcard_set_dma(drive);
+    dprintf(3, "sdcard %p dma mode %d hostctl %x\n", regs, drive->dma_mode
+            , readb(&regs->host_control));
     char pnm[7] = {};
     int i;
     for (i=0; i < (drive->card_type & SF_MMC ? 6 : 5); i++)
@@ -494,7 +843,7 @@ sdcard_controller_setup(struct sdhci_s *regs, int prio)
     writew(&regs->irq_enable, 0x01ff);
     writew(&regs->irq_status, readw(&regs->irq_status));
     writew(&regs->error_signal, 0);
-    writew(&regs->error_irq_enable, 0x01ff);
+    writew(&regs->error_irq_enable, 0x03ff);
     writew(&regs->error_irq_status, readw(&regs->error_irq_status));
     writeb(&regs->timeout_control, 0x0e); // Set to max timeout
     int volt = sdcard_set_power(regs);
@@ -512,6 +861,7 @@ sdcard_controller_setup(struct sdhci_s *regs, int prio)
     drive->regs = regs;
     int ret = sdcard_card_setup(drive, volt, prio);
     if (ret) {
+        free(drive->adma);
         free(drive);
         goto fail;
     }
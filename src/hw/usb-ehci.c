@@ -30,9 +30,16 @@ struct ehci_pipe {
     struct ehci_qh qh;
     struct ehci_qtd *next_td, *tds;
     void *data;
+    int tdcount;
     struct usb_pipe pipe;
 };
 
+// Number of qtds in the chain of a control or bulk pipe.  Each qtd
+// covers at least 16KB, so a bulk chain fits a 64KB transfer at any
+// buffer alignment.
+#define EHCI_CONTROL_QTDS 6
+#define EHCI_BULK_QTDS (DIV_ROUND_UP(64*1024, 4*PAGE_SIZE) + 1)
+
 static int PendingEHCI;
 
 
@@ -208,6 +215,7 @@ ehci_free_pipes(struct usb_ehci_s *cntl)
             break;
         cntl->usb.freelist = usbpipe->freenext;
         struct ehci_pipe *pipe = container_of(usbpipe, struct ehci_pipe, pipe);
+        free(pipe->tds);
         free(pipe);
     }
 }
@@ -471,17 +479,29 @@ ehci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
         return usbpipe;
     }
 
-    // Allocate a new queue head.
+    // Allocate a new queue head and its qtd chain.
     struct ehci_pipe *pipe;
-    if (eptype == USB_ENDPOINT_XFER_CONTROL)
+    struct ehci_qtd *tds;
+    int tdcount;
+    if (eptype == USB_ENDPOINT_XFER_CONTROL) {
+        tdcount = EHCI_CONTROL_QTDS;
         pipe = memalign_tmphigh(EHCI_QH_ALIGN, sizeof(*pipe));
-    else
+        tds = memalign_tmphigh(EHCI_QTD_ALIGN, sizeof(*tds) * tdcount);
+    } else {
+        tdcount = EHCI_BULK_QTDS;
         pipe = memalign_low(EHCI_QH_ALIGN, sizeof(*pipe));
-    if (!pipe) {
+        tds = memalign_low(EHCI_QTD_ALIGN, sizeof(*tds) * tdcount);
+    }
+    if (!pipe || !tds) {
         warn_noalloc();
+        free(pipe);
+        free(tds);
         return NULL;
     }
     memset(pipe, 0, sizeof(*pipe));
+    memset(tds, 0, sizeof(*tds) * tdcount);
+    pipe->tds = tds;
+    pipe->tdcount = tdcount;
     ehci_desc2pipe(pipe, usbdev, epdesc);
     pipe->qh.qtd_next = pipe->qh.alt_next = EHCI_PTR_TERM;
 
@@ -507,9 +527,15 @@ ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
 {
     u32 status;
     for (;;) {
-        status = td->token;
+        status = GET_LOWFLAT(td->token);
         if (!(status & QTD_STS_ACTIVE))
             break;
+        // A halt on an earlier qtd in the chain stops the queue.
+        u32 tok = GET_LOWFLAT(pipe->qh.token);
+        if (tok & QTD_STS_HALT) {
+            status = tok;
+            break;
+        }
         if (timer_check(end)) {
             u32 cur = GET_LOWFLAT(pipe->qh.current);
             u32 tok = GET_LOWFLAT(pipe->qh.token);
@@ -533,16 +559,22 @@ ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
     return 0;
 }
 
+// Fill in one qtd of a pipe's chain.  The token is written last.
 static void
-ehci_fill_tdbuf(struct ehci_qtd *td, u32 dest, int transfer)
+ehci_fill_td(struct ehci_qtd *td, u32 next, u32 token, u32 dest, int transfer)
 {
-    u32 *pos = td->buf, end = dest + transfer;
-    for (; dest < end; dest = ALIGN_DOWN(dest + PAGE_SIZE, PAGE_SIZE))
-        *pos++ = dest;
+    SET_LOWFLAT(td->qtd_next, next);
+    SET_LOWFLAT(td->alt_next, EHCI_PTR_TERM);
+    u32 end = dest + transfer;
+    int i;
+    for (i=0; i<ARRAY_SIZE(td->buf); i++) {
+        SET_LOWFLAT(td->buf[i], dest < end ? dest : 0);
+        dest = ALIGN_DOWN(dest + PAGE_SIZE, PAGE_SIZE);
+    }
+    barrier();
+    SET_LOWFLAT(td->token, token);
 }
 
-#define STACKQTDS 6
-
 int
 ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                , void *data, int datasize)
@@ -553,28 +585,24 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     dprintf(7, "ehci_send_pipe qh=%p dir=%d data=%p size=%d\n"
             , &pipe->qh, dir, data, datasize);
 
-    // Allocate tds on stack (with required alignment)
-    u8 tdsbuf[sizeof(struct ehci_qtd) * STACKQTDS + EHCI_QTD_ALIGN - 1];
-    struct ehci_qtd *tds = (void*)ALIGN((u32)tdsbuf, EHCI_QTD_ALIGN), *td = tds;
-    memset(tds, 0, sizeof(*tds) * STACKQTDS);
-
-    // Setup transfer descriptors
+    // Setup the pipe's qtd chain for the whole transfer
+    struct ehci_qtd *tds = GET_LOWFLAT(pipe->tds), *td = tds;
+    struct ehci_qtd *tdend = tds + GET_LOWFLAT(pipe->tdcount);
     u16 maxpacket = GET_LOWFLAT(pipe->pipe.maxpacket);
     u32 toggle = 0;
     if (cmd) {
         // Send setup pid on control transfers
-        td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (ehci_explen(USB_CONTROL_SETUP_SIZE) | QTD_STS_ACTIVE
-                     | QTD_PID_SETUP | ehci_maxerr(3));
-        ehci_fill_tdbuf(td, (u32)cmd, USB_CONTROL_SETUP_SIZE);
+        ehci_fill_td(td, (u32)(td+1)
+                     , (ehci_explen(USB_CONTROL_SETUP_SIZE) | QTD_STS_ACTIVE
+                        | QTD_PID_SETUP | ehci_maxerr(3))
+                     , (u32)cmd, USB_CONTROL_SETUP_SIZE);
         td++;
         toggle = QTD_TOGGLE;
     }
     u32 dest = (u32)data, dataend = dest + datasize;
     while (dest < dataend) {
         // Send data pids
-        if (td >= &tds[STACKQTDS]) {
+        if (td >= tdend) {
             warn_noalloc();
             return -1;
         }
@@ -582,38 +610,35 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
         int transfer = dataend - dest;
         if (transfer > maxtransfer)
             transfer = ALIGN_DOWN(maxtransfer, maxpacket);
-        td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
-                     | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3));
-        ehci_fill_tdbuf(td, dest, transfer);
+        ehci_fill_td(td, (u32)(td+1)
+                     , (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
+                        | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3))
+                     , dest, transfer);
         td++;
         dest += transfer;
     }
     if (cmd) {
         // Send status pid on control transfers
-        if (td >= &tds[STACKQTDS]) {
+        if (td >= tdend) {
             warn_noalloc();
             return -1;
         }
-        td->qtd_next = EHCI_PTR_TERM;
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (QTD_TOGGLE | QTD_STS_ACTIVE
-                     | (dir ? QTD_PID_OUT : QTD_PID_IN) | ehci_maxerr(3));
+        ehci_fill_td(td, EHCI_PTR_TERM
+                     , (QTD_TOGGLE | QTD_STS_ACTIVE
+                        | (dir ? QTD_PID_OUT : QTD_PID_IN) | ehci_maxerr(3))
+                     , 0, 0);
         td++;
     }
 
-    // Transfer data
-    (td-1)->qtd_next = EHCI_PTR_TERM;
+    // Link the chain to the queue head and wait for its last qtd
+    struct ehci_qtd *last = td - 1;
+    SET_LOWFLAT(last->qtd_next, EHCI_PTR_TERM);
     barrier();
-    SET_LOWFLAT(pipe->qh.qtd_next, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
+    SET_LOWFLAT(pipe->qh.qtd_next, (u32)tds);
     u32 end = timer_calc(usb_xfer_time(p, datasize));
-    int i;
-    for (i=0, td=tds; i<STACKQTDS; i++, td++) {
-        int ret = ehci_wait_td(pipe, td, end);
-        if (ret)
-            return -1;
-    }
+    int ret = ehci_wait_td(pipe, last, end);
+    if (ret)
+        return -1;
 
     return 0;
 }
@@ -61,17 +61,16 @@ usb_msc_send(struct usbdrive_s *udrive_gf, int dir, void *buf, u32 bytes)
     return usb_send_bulk(pipe, dir, buf, bytes);
 }
 
+// Largest data phase of a single command.  The bulk transfer chains
+// of the ohci and ehci drivers cover a little more than this.
+#define USB_MSC_MAX_XFER (64*1024)
+
 // Low-level usb command transmit function.
-int
-usb_process_op(struct disk_op_s *op)
+static int
+usb_msc_cmd(struct usbdrive_s *udrive_gf, struct disk_op_s *op)
 {
-    if (!CONFIG_USB_MSC)
-        return 0;
-
     dprintf(16, "usb_cmd_data id=%p write=%d count=%d buf=%p\n"
             , op->drive_fl, 0, op->count, op->buf_fl);
-    struct usbdrive_s *udrive_gf = container_of(
-        op->drive_fl, struct usbdrive_s, drive);
 
     // Setup command block wrapper.
     struct cbw_s cbw;
@@ -122,6 +121,38 @@ fail:
     return DISK_RET_EBADTRACK;
 }
 
+// Send a request, splitting large reads and writes into several
+// commands of at most USB_MSC_MAX_XFER bytes.
+int
+usb_process_op(struct disk_op_s *op)
+{
+    if (!CONFIG_USB_MSC)
+        return 0;
+
+    struct usbdrive_s *udrive_gf = container_of(
+        op->drive_fl, struct usbdrive_s, drive);
+    u16 max = GET_GLOBALFLAT(udrive_gf->drive.max_sectors);
+    if ((op->command != CMD_READ && op->command != CMD_WRITE)
+        || !max || op->count <= max)
+        return usb_msc_cmd(udrive_gf, op);
+
+    u16 blksize = GET_GLOBALFLAT(udrive_gf->drive.blksize);
+    struct disk_op_s subop = *op;
+    u16 done = 0;
+    while (done < op->count) {
+        subop.count = op->count - done < max ? op->count - done : max;
+        int ret = usb_msc_cmd(udrive_gf, &subop);
+        if (ret) {
+            op->count = done + subop.count;
+            return ret;
+        }
+        done += subop.count;
+        subop.lba += subop.count;
+        subop.buf_fl += subop.count * blksize;
+    }
+    return DISK_RET_SUCCESS;
+}
+
 static int
 usb_msc_maxlun(struct usb_pipe *pipe)
 {
@@ -164,6 +195,7 @@ usb_msc_lun_setup(struct usb_pipe *inpipe, struct usb_pipe *outpipe,
         free(drive);
         return -1;
     }
+    drive->drive.max_sectors = USB_MSC_MAX_XFER / drive->drive.blksize;
     return 0;
 }
 
@@ -1,10 +1,7 @@
 // Code for handling usb attached scsi devices.
 //
-// only usb 2.0 for now.
-//
-// once we have xhci driver with usb 3.0 support this must
-// be updated to use usb3 streams so booting from usb3
-// devices actually works.
+// usb 2.0 devices use a single tag and the read/write ready ius.
+// usb 3.0 devices on xhci use bulk streams, with one stream per tag.
 //
 // Authors:
 //  Gerd Hoffmann <kraxel@redhat.com>
@@ -17,6 +14,7 @@
 #include "biosvar.h" // GET_GLOBALFLAT
 #include "block.h" // DTYPE_USB
 #include "blockcmd.h" // cdb_read
+#include "byteorder.h" // cpu_to_be16
 #include "config.h" // CONFIG_USB_UAS
 #include "malloc.h" // free
 #include "output.h" // dprintf
@@ -38,6 +36,13 @@
 #define UAS_PIPE_ID_DATA_IN         0x03
 #define UAS_PIPE_ID_DATA_OUT        0x04
 
+// Commands kept in flight on usb3 stream devices (tags 1..n).
+#define UAS_MAX_TAGS                4
+// Smallest read or write that is given a tag of its own.
+#define UAS_TAG_MIN_BLOCKS          8
+// Largest data transfer of one tag (it must fit a single xhci TD).
+#define UAS_TAG_MAX_XFER            (512*1024)
+
 typedef struct {
     u8    id;
     u8    reserved;
@@ -89,8 +94,107 @@ struct uasdrive_s {
     struct usbdevice_s *usbdev;
     struct usb_pipe *command, *status, *data_in, *data_out;
     u32 lun;
+    u8 tags;
 };
 
+// Process a request on a usb3 device.  The status and data transfers
+// for each tag are queued on the stream of the same number before
+// the command iu is sent, and large reads and writes are split so
+// that several tagged commands are outstanding at once.
+static int
+uas_process_op_streams(struct uasdrive_s *drive_gf, struct disk_op_s *op)
+{
+    uas_ui cmd[UAS_MAX_TAGS], sense[UAS_MAX_TAGS];
+    int len[UAS_MAX_TAGS];
+    struct usb_pipe *data = (scsi_is_read(op) ? drive_gf->data_in
+                             : drive_gf->data_out);
+
+    int tags = 1;
+    if (op->command == CMD_READ || op->command == CMD_WRITE) {
+        tags = DIV_ROUND_UP(op->count, UAS_TAG_MIN_BLOCKS);
+        if (tags > drive_gf->tags)
+            tags = drive_gf->tags;
+    }
+    u16 per = DIV_ROUND_UP(op->count, tags);
+    if (per)
+        tags = DIV_ROUND_UP(op->count, per);
+
+    int i, queued = 0, orphan = 0, ret;
+    void *buf = op->buf_fl;
+    for (i = 0; i < tags; i++) {
+        struct disk_op_s dop = *op;
+        dop.lba = op->lba + i * per;
+        dop.count = (op->count - i * per < per) ? op->count - i * per : per;
+        dop.buf_fl = buf;
+
+        u16 tag = i + 1;
+        memset(&cmd[i], 0, sizeof(cmd[i]));
+        cmd[i].hdr.id = UAS_UI_COMMAND;
+        cmd[i].hdr.tag = cpu_to_be16(tag);
+        cmd[i].command.lun[1] = drive_gf->lun;
+        int blocksize = scsi_fill_cmd(&dop, cmd[i].command.cdb
+                                      , sizeof(cmd[i].command.cdb));
+        if (blocksize < 0) {
+            if (!i)
+                return default_process_op(op);
+            goto wait;
+        }
+        len[i] = dop.count * blocksize;
+        buf += len[i];
+
+        memset(&sense[i], 0xff, sizeof(sense[i]));
+        ret = usb_stream_queue(drive_gf->status, tag, &sense[i]
+                               , sizeof(sense[i]));
+        if (ret) {
+            dprintf(1, "uas: stream queue fail (tag %d)\n", tag);
+            goto wait;
+        }
+        // From here on a failure leaves transfers queued for a tag
+        // that the device never sees, so they must be dropped again.
+        orphan = tag;
+        if (len[i]) {
+            ret = usb_stream_queue(data, tag, dop.buf_fl, len[i]);
+            if (ret) {
+                dprintf(1, "uas: stream queue fail (tag %d)\n", tag);
+                goto wait;
+            }
+        }
+        ret = usb_send_bulk(drive_gf->command, USB_DIR_OUT, &cmd[i]
+                            , sizeof(cmd[i].hdr) + sizeof(cmd[i].command));
+        if (ret) {
+            dprintf(1, "uas: command send fail (tag %d)\n", tag);
+            goto wait;
+        }
+        orphan = 0;
+        queued++;
+    }
+
+wait:
+    ret = (queued == tags) ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    for (i = 0; i < queued; i++) {
+        u16 tag = i + 1;
+        if (len[i] && usb_stream_wait(data, tag, len[i])) {
+            dprintf(1, "uas: data xfer fail (tag %d)\n", tag);
+            ret = DISK_RET_EBADTRACK;
+        }
+        if (usb_stream_wait(drive_gf->status, tag, sizeof(sense[i]))) {
+            dprintf(1, "uas: status recv fail (tag %d)\n", tag);
+            ret = DISK_RET_EBADTRACK;
+            continue;
+        }
+        if (sense[i].hdr.id != UAS_UI_SENSE || sense[i].sense.status) {
+            dprintf(1, "uas: tag %d failed (ui id %d, status %d)\n"
+                    , tag, sense[i].hdr.id, sense[i].sense.status);
+            ret = DISK_RET_EBADTRACK;
+        }
+    }
+    if (orphan) {
+        usb_stream_cancel(drive_gf->status, orphan);
+        usb_stream_cancel(data, orphan);
+    }
+    return ret;
+}
+
 int
 uas_process_op(struct disk_op_s *op)
 {
@@ -99,6 +203,8 @@ uas_process_op(struct disk_op_s *op)
 
     struct uasdrive_s *drive_gf = container_of(
         op->drive_fl, struct uasdrive_s, drive);
+    if (!MODESEGMENT && drive_gf->tags)
+        return uas_process_op_streams(drive_gf, op);
 
     uas_ui ui;
     memset(&ui, 0, sizeof(ui));
@@ -186,6 +292,16 @@ uas_init_lun(struct uasdrive_s *drive, struct usbdevice_s *usbdev,
     drive->data_in = data_in;
     drive->data_out = data_out;
     drive->lun = lun;
+    if (status->streams && data_in->streams && data_out->streams) {
+        int tags = status->streams;
+        if (data_in->streams < tags)
+            tags = data_in->streams;
+        if (data_out->streams < tags)
+            tags = data_out->streams;
+        if (tags > UAS_MAX_TAGS)
+            tags = UAS_MAX_TAGS;
+        drive->tags = tags;
+    }
 }
 
 static int
@@ -209,9 +325,29 @@ uas_add_lun(u32 lun, struct drive_s *tmpl_drv)
         free(drive);
         return -1;
     }
+    if (drive->tags)
+        drive->drive.max_sectors = (drive->tags * UAS_TAG_MAX_XFER
+                                    / drive->drive.blksize);
     return 0;
 }
 
+// Allocate a status or data pipe, using streams on usb3 devices.
+static struct usb_pipe *
+uas_alloc_pipe(struct usbdevice_s *usbdev
+               , struct usb_endpoint_descriptor *ep, int streams)
+{
+    if (usbdev->speed != USB_SUPERSPEED)
+        return usb_alloc_pipe(usbdev, ep);
+    if (!streams) {
+        dprintf(1, "uas: superspeed endpoint without streams\n");
+        return NULL;
+    }
+    struct usb_pipe *pipe = usb_alloc_stream_pipe(usbdev, ep, streams);
+    if (!pipe)
+        dprintf(1, "uas: unable to allocate bulk streams\n");
+    return pipe;
+}
+
 int
 usb_uas_setup(struct usbdevice_s *usbdev)
 {
@@ -229,6 +365,7 @@ usb_uas_setup(struct usbdevice_s *usbdev)
 
     /* find & allocate pipes */
     struct usb_endpoint_descriptor *ep = NULL;
+    int streams = 0;
     struct usb_pipe *command = NULL;
     struct usb_pipe *status = NULL;
     struct usb_pipe *data_in = NULL;
@@ -239,24 +376,29 @@ usb_uas_setup(struct usbdevice_s *usbdev)
         switch (desc[1]) {
         case USB_DT_ENDPOINT:
             ep = (void*)desc;
+            streams = 0;
             break;
-        case USB_DT_ENDPOINT_COMPANION:
-            /* No support (yet) for usb3 streams */
-            dprintf(1, "Superspeed UAS devices not supported (yet)\n");
-            goto fail;
+        case USB_DT_ENDPOINT_COMPANION: {
+            struct usb_ss_ep_comp_descriptor *comp = (void*)desc;
+            int maxstreams = comp->bmAttributes & USB_SS_EP_MAXSTREAMS_MASK;
+            if (maxstreams)
+                streams = (1 << maxstreams) < UAS_MAX_TAGS
+                          ? (1 << maxstreams) : UAS_MAX_TAGS;
+            break;
+        }
         case 0x24:
             switch (desc[2]) {
             case UAS_PIPE_ID_COMMAND:
                 command = usb_alloc_pipe(usbdev, ep);
                 break;
             case UAS_PIPE_ID_STATUS:
-                status = usb_alloc_pipe(usbdev, ep);
+                status = uas_alloc_pipe(usbdev, ep, streams);
                 break;
             case UAS_PIPE_ID_DATA_IN:
-                data_in = usb_alloc_pipe(usbdev, ep);
+                data_in = uas_alloc_pipe(usbdev, ep, streams);
                 break;
             case UAS_PIPE_ID_DATA_OUT:
-                data_out = usb_alloc_pipe(usbdev, ep);
+                data_out = uas_alloc_pipe(usbdev, ep, streams);
                 break;
             default:
                 goto fail;
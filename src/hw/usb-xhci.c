@@ -31,6 +31,15 @@
 #define XHCI_RING(_trb)          \
     ((struct xhci_ring*)((u32)(_trb) & ~(XHCI_RING_SIZE-1)))
 
+// A transfer TRB may not cross a 64KB boundary.
+#define XHCI_TRB_MAX_XFER        (64*1024)
+
+// TRBs of a single TD - the ring also needs room for its link TRB.
+#define XHCI_TD_MAX_TRBS         (XHCI_RING_ITEMS - 2)
+
+// Largest primary stream array allocated for a bulk endpoint.
+#define XHCI_MAX_STREAMS         16
+
 // --------------------------------------------------------------
 // bit definitions
 
@@ -84,6 +93,9 @@
 #define XHCI_PORTSC_DR           (1<<30)
 #define XHCI_PORTSC_WPR          (1<<31)
 
+#define XHCI_EP_LSA              (1<<15)
+#define XHCI_SCT_PRIMARY_TR      (1<<1)
+
 #define TRB_C               (1<<0)
 #define TRB_TYPE_SHIFT          10
 #define TRB_TYPE_MASK       0x3f
@@ -100,6 +112,8 @@
 #define TRB_TR_TBC_SHIFT        7
 #define TRB_TR_TBC_MASK     0x3
 #define TRB_TR_BEI          (1<<9)
+#define TRB_TR_TDSIZE_SHIFT     17
+#define TRB_TR_TDSIZE_MASK  0x1f
 #define TRB_TR_TLBPC_SHIFT      16
 #define TRB_TR_TLBPC_MASK   0xf
 #define TRB_TR_FRAMEID_SHIFT    20
@@ -239,6 +253,7 @@ struct usb_xhci_s {
     u32                  ports;
     u32                  slots;
     u8                   context64;
+    u8                   maxpsa;
     struct xhci_portmap  usb2;
     struct xhci_portmap  usb3;
 
@@ -264,6 +279,10 @@ struct xhci_pipe {
     u32                  epid;
     void                 *buf;
     int                  bufused;
+
+    /* usb3 bulk streams */
+    struct xhci_streamctx *sctx;
+    struct xhci_ring     **srings;
 };
 
 // --------------------------------------------------------------
@@ -555,6 +574,7 @@ xhci_controller_setup(void *baseaddr)
     xhci->slots = hcs1         & 0xff;
     xhci->xcap  = ((hcc >> 16) & 0xffff) << 2;
     xhci->context64 = (hcc & 0x04) ? 1 : 0;
+    xhci->maxpsa = (hcc >> 12) & 0x0f;
     xhci->usb.type = USB_TYPE_XHCI;
 
     dprintf(1, "XHCI init: regs @ %p, %d ports, %d slots"
@@ -695,19 +715,33 @@ static void xhci_doorbell(struct usb_xhci_s *xhci, u32 slotid, u32 value)
     writel(addr, value);
 }
 
+// Return the ring index following the last TRB of the TD that
+// contains the TRB at index 'idx'.
+static u32 xhci_td_end(struct xhci_ring *ring, u32 idx)
+{
+    for (;;) {
+        u32 control = ring->ring[idx].control;
+        if (!(control & TRB_TR_CH))
+            return idx + 1;
+        idx++;
+        if (TRB_TYPE(ring->ring[idx].control) == TR_LINK)
+            idx = 0;
+    }
+}
+
 // Dequeue events on the XHCI command ring generated by the hardware
 static void xhci_process_events(struct usb_xhci_s *xhci)
 {
     struct xhci_ring *evts = xhci->evts;
+    u32 nidx = evts->nidx;
+    u32 cs = evts->cs;
 
     for (;;) {
         /* check for event */
-        u32 nidx = evts->nidx;
-        u32 cs = evts->cs;
         struct xhci_trb *etrb = evts->ring + nidx;
         u32 control = etrb->control;
         if ((control & TRB_C) != (cs ? 1 : 0))
-            return;
+            break;
 
         /* process event */
         u32 evt_type = TRB_TYPE(control);
@@ -720,6 +754,9 @@ static void xhci_process_events(struct usb_xhci_s *xhci)
             struct xhci_ring *ring = XHCI_RING(rtrb);
             struct xhci_trb  *evt = &ring->evt;
             u32 eidx = rtrb - ring->ring + 1;
+            if (evt_type == ER_TRANSFER && evt_cc == CC_SHORT_PACKET)
+                // The rest of the TD is skipped after a short packet
+                eidx = xhci_td_end(ring, eidx - 1);
             dprintf(5, "%s: ring %p [trb %p, evt %p, type %d, eidx %d, cc %d]\n",
                     __func__, ring, rtrb, evt, evt_type, eidx, evt_cc);
             memcpy(evt, etrb, sizeof(*etrb));
@@ -745,19 +782,23 @@ static void xhci_process_events(struct usb_xhci_s *xhci)
             break;
         }
 
-        /* move ring index, notify xhci */
+        /* move ring index */
         nidx++;
         if (nidx == XHCI_RING_ITEMS) {
             nidx = 0;
             cs = cs ? 0 : 1;
-            evts->cs = cs;
         }
-        evts->nidx = nidx;
-        struct xhci_ir *ir = xhci->ir;
-        u32 erdp = (u32)(evts->ring + nidx);
-        writel(&ir->erdp_low, erdp);
-        writel(&ir->erdp_high, 0);
     }
+
+    /* notify xhci once for all dequeued events */
+    if (nidx == evts->nidx && cs == evts->cs)
+        return;
+    evts->nidx = nidx;
+    evts->cs = cs;
+    struct xhci_ir *ir = xhci->ir;
+    u32 erdp = (u32)(evts->ring + nidx);
+    writel(&ir->erdp_low, erdp);
+    writel(&ir->erdp_high, 0);
 }
 
 // Check if a ring has any pending TRBs
@@ -809,7 +850,10 @@ static void xhci_trb_queue(struct xhci_ring *ring,
                            void *data, u32 xferlen, u32 flags)
 {
     if (ring->nidx >= ARRAY_SIZE(ring->ring) - 1) {
-        xhci_trb_fill(ring, ring->ring, 0, (TR_LINK << 10) | TRB_LK_TC);
+        // The link TRB must carry the chain bit when it splits a TD.
+        u32 chain = ring->ring[ring->nidx - 1].control & TRB_TR_CH;
+        xhci_trb_fill(ring, ring->ring, 0
+                      , (TR_LINK << 10) | TRB_LK_TC | chain);
         ring->nidx = 0;
         ring->cs ^= 1;
         dprintf(5, "%s: ring %p [linked]\n", __func__, ring);
@@ -821,6 +865,18 @@ static void xhci_trb_queue(struct xhci_ring *ring,
             __func__, ring, ring->nidx, xferlen);
 }
 
+// Queue a raw command TRB and wait for its completion
+static int xhci_cmd_submit_trb(struct usb_xhci_s *xhci, void *ptr
+                               , u32 status, u32 flags)
+{
+    mutex_lock(&xhci->cmds->lock);
+    xhci_trb_queue(xhci->cmds, ptr, status, flags);
+    xhci_doorbell(xhci, 0, 0);
+    int rc = xhci_event_wait(xhci, xhci->cmds, 1000);
+    mutex_unlock(&xhci->cmds->lock);
+    return rc;
+}
+
 // Submit a command to the xhci controller ring
 static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
                            , u32 flags)
@@ -836,12 +892,7 @@ static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
         }
     }
 
-    mutex_lock(&xhci->cmds->lock);
-    xhci_trb_queue(xhci->cmds, inctx, 0, flags);
-    xhci_doorbell(xhci, 0, 0);
-    int rc = xhci_event_wait(xhci, xhci->cmds, 1000);
-    mutex_unlock(&xhci->cmds->lock);
-    return rc;
+    return xhci_cmd_submit_trb(xhci, inctx, 0, flags);
 }
 
 static int xhci_cmd_enable_slot(struct usb_xhci_s *xhci)
@@ -885,6 +936,24 @@ static int xhci_cmd_evaluate_context(struct usb_xhci_s *xhci, u32 slotid
                            , (CR_EVALUATE_CONTEXT << 10) | (slotid << 24));
 }
 
+static int xhci_cmd_stop_endpoint(struct usb_xhci_s *xhci, u32 slotid
+                                  , u32 epid)
+{
+    dprintf(3, "%s: slotid %d, epid %d\n", __func__, slotid, epid);
+    return xhci_cmd_submit(xhci, NULL, (CR_STOP_ENDPOINT << 10)
+                           | (epid << 16) | (slotid << 24));
+}
+
+static int xhci_cmd_set_tr_dequeue(struct usb_xhci_s *xhci, u32 slotid
+                                   , u32 epid, u16 stream, u32 deq)
+{
+    dprintf(3, "%s: slotid %d, epid %d, stream %d\n", __func__
+            , slotid, epid, stream);
+    return xhci_cmd_submit_trb(xhci, (void*)deq, stream << 16
+                               , (CR_SET_TR_DEQUEUE << 10)
+                               | (epid << 16) | (slotid << 24));
+}
+
 static struct xhci_inctx *
 xhci_alloc_inctx(struct usbdevice_s *usbdev, int maxepid)
 {
@@ -957,9 +1026,69 @@ static int xhci_config_hub(struct usbhub_s *hub)
     return 0;
 }
 
+static void
+xhci_free_streams(struct xhci_pipe *pipe)
+{
+    if (pipe->srings) {
+        int i;
+        for (i = 1; i <= pipe->pipe.streams; i++)
+            free(pipe->srings[i]);
+    }
+    free(pipe->srings);
+    free(pipe->sctx);
+    pipe->srings = NULL;
+    pipe->sctx = NULL;
+    pipe->pipe.streams = 0;
+}
+
+// Allocate a linear primary stream array with a transfer ring for
+// each stream.  Returns the MaxPStreams value for the endpoint context.
+static int
+xhci_alloc_streams(struct usb_xhci_s *xhci, struct xhci_pipe *pipe
+                   , int streams)
+{
+    // Stream id 0 is reserved, so the array needs streams+1 entries,
+    // rounded up to a power of two of at least 4 (MaxPStreams >= 1).
+    int size = 4;
+    while (size < streams + 1)
+        size <<= 1;
+    if (size > XHCI_MAX_STREAMS)
+        size = XHCI_MAX_STREAMS;
+    if (size > (2 << xhci->maxpsa))
+        size = 2 << xhci->maxpsa;
+    if (streams > size - 1)
+        streams = size - 1;
+
+    pipe->sctx = memalign_high(size * sizeof(*pipe->sctx)
+                               , size * sizeof(*pipe->sctx));
+    pipe->srings = malloc_high(size * sizeof(*pipe->srings));
+    if (!pipe->sctx || !pipe->srings)
+        goto fail;
+    memset(pipe->sctx, 0, size * sizeof(*pipe->sctx));
+    memset(pipe->srings, 0, size * sizeof(*pipe->srings));
+    int i;
+    for (i = 1; i <= streams; i++) {
+        struct xhci_ring *ring = memalign_high(XHCI_RING_SIZE, sizeof(*ring));
+        if (!ring)
+            goto fail;
+        memset(ring, 0, sizeof(*ring));
+        ring->cs = 1;
+        pipe->srings[i] = ring;
+        pipe->pipe.streams = i;
+        pipe->sctx[i].deq_low = (u32)&ring->ring[0];
+        pipe->sctx[i].deq_low |= XHCI_SCT_PRIMARY_TR | 1; // dcs
+    }
+    return __fls(size) - 1;
+
+fail:
+    warn_noalloc();
+    xhci_free_streams(pipe);
+    return -1;
+}
+
 static struct usb_pipe *
 xhci_alloc_pipe(struct usbdevice_s *usbdev
-                , struct usb_endpoint_descriptor *epdesc)
+                , struct usb_endpoint_descriptor *epdesc, int streams)
 {
     u8 eptype = epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
     struct usb_xhci_s *xhci = container_of(
@@ -1012,9 +1141,17 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     ep->deq_low  = (u32)&pipe->reqs.ring[0];
     ep->deq_low  |= 1;         // dcs
     ep->length   = pipe->pipe.maxpacket;
+    if (streams && eptype == USB_ENDPOINT_XFER_BULK && xhci->maxpsa) {
+        int maxpstreams = xhci_alloc_streams(xhci, pipe, streams);
+        if (maxpstreams < 0)
+            goto fail;
+        ep->ctx[0] |= XHCI_EP_LSA | (maxpstreams << 10);
+        ep->deq_low = (u32)pipe->sctx;
+    }
 
-    dprintf(3, "%s: usbdev %p, ring %p, slotid %d, epid %d\n", __func__,
-            usbdev, &pipe->reqs, pipe->slotid, pipe->epid);
+    dprintf(3, "%s: usbdev %p, ring %p, slotid %d, epid %d, streams %d\n"
+            , __func__, usbdev, &pipe->reqs, pipe->slotid, pipe->epid
+            , pipe->pipe.streams);
     if (pipe->epid == 1) {
         if (usbdev->hub->usbdev) {
             // Make sure parent hub is configured.
@@ -1069,12 +1206,28 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     return &pipe->pipe;
 
 fail:
+    xhci_free_streams(pipe);
     free(pipe->buf);
     free(pipe);
     free(in);
     return NULL;
 }
 
+// Allocate a bulk pipe that uses usb3 bulk streams.
+struct usb_pipe *
+xhci_alloc_stream_pipe(struct usbdevice_s *usbdev
+                       , struct usb_endpoint_descriptor *epdesc, int streams)
+{
+    if (!CONFIG_USB_XHCI)
+        return NULL;
+    struct usb_pipe *pipe = xhci_alloc_pipe(usbdev, epdesc, streams);
+    if (pipe && !pipe->streams) {
+        usb_add_freelist(pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
 struct usb_pipe *
 xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
                   , struct usb_endpoint_descriptor *epdesc)
@@ -1086,7 +1239,7 @@ xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
         return NULL;
     }
     if (!upipe)
-        return xhci_alloc_pipe(usbdev, epdesc);
+        return xhci_alloc_pipe(usbdev, epdesc, 0);
     u8 eptype = epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
     int oldmaxpacket = upipe->maxpacket;
     usb_desc2pipe(upipe, usbdev, epdesc);
@@ -1134,13 +1287,55 @@ static void xhci_xfer_setup(struct xhci_pipe *pipe, int dir, void *cmd
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
+// Return how many bytes of a transfer starting at 'data' fit in one
+// TD.  A TD that doesn't cover the whole transfer ends on a packet
+// boundary so the next TD continues the same data stream.
+static int xhci_td_len(void *data, int datalen, u16 maxpacket)
+{
+    u32 addr = (u32)data;
+    int max = (XHCI_TD_MAX_TRBS * XHCI_TRB_MAX_XFER
+               - (addr & (XHCI_TRB_MAX_XFER - 1)));
+    if (datalen <= max)
+        return datalen;
+    return ALIGN_DOWN(max, maxpacket);
+}
+
+// Queue a transfer as a single TD of chained normal TRBs, starting a
+// new TRB at each 64KB boundary.  The caller must limit datalen with
+// xhci_td_len().  Chained IN TRBs get ISP set, so that a short packet
+// in the middle of the TD still generates an event.
+static void xhci_xfer_queue(struct xhci_ring *ring, u16 maxpacket
+                            , void *data, int datalen, int isin)
+{
+    u32 addr = (u32)data;
+    int remain = datalen;
+    for (;;) {
+        int len = XHCI_TRB_MAX_XFER - (addr & (XHCI_TRB_MAX_XFER - 1));
+        if (len > remain)
+            len = remain;
+        remain -= len;
+        u32 tdsize = DIV_ROUND_UP(remain, maxpacket);
+        if (tdsize > TRB_TR_TDSIZE_MASK)
+            tdsize = TRB_TR_TDSIZE_MASK;
+        u32 flags = (TR_NORMAL << 10) | (remain ? TRB_TR_CH : TRB_TR_IOC);
+        if (remain && isin)
+            flags |= TRB_TR_ISP;
+        xhci_trb_queue(ring, (void*)addr
+                       , len | (tdsize << TRB_TR_TDSIZE_SHIFT), flags);
+        if (!remain)
+            break;
+        addr += len;
+    }
+}
+
 // Submit a USB transfer request to the pipe's ring
 static void xhci_xfer_normal(struct xhci_pipe *pipe,
                              void *data, int datalen)
 {
     struct usb_xhci_s *xhci = container_of(
         pipe->pipe.cntl, struct usb_xhci_s, usb);
-    xhci_trb_queue(&pipe->reqs, data, datalen, (TR_NORMAL << 10) | TRB_TR_IOC);
+    xhci_xfer_queue(&pipe->reqs, pipe->pipe.maxpacket, data, datalen
+                    , pipe->epid & 1);
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
@@ -1160,16 +1355,102 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
             // Set address command sent during xhci_alloc_pipe.
             return 0;
         xhci_xfer_setup(pipe, dir, (void*)req, data, datalen);
-    } else {
-        xhci_xfer_normal(pipe, data, datalen);
+        int cc = xhci_event_wait(xhci, &pipe->reqs
+                                 , usb_xfer_time(p, datalen));
+        if (cc != CC_SUCCESS) {
+            dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+            return -1;
+        }
+        return 0;
     }
 
-    int cc = xhci_event_wait(xhci, &pipe->reqs, usb_xfer_time(p, datalen));
+    // Transfers too large for the ring are sent as several TDs
+    u16 maxpacket = pipe->pipe.maxpacket;
+    for (;;) {
+        int len = xhci_td_len(data, datalen, maxpacket);
+        xhci_xfer_normal(pipe, data, len);
+        int cc = xhci_event_wait(xhci, &pipe->reqs, usb_xfer_time(p, len));
+        if (cc != CC_SUCCESS) {
+            dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+            return -1;
+        }
+        data += len;
+        datalen -= len;
+        if (!datalen)
+            return 0;
+    }
+}
+
+// Queue a transfer on one stream of a bulk stream pipe.
+int
+xhci_stream_queue(struct usb_pipe *p, u16 stream, void *data, int datalen)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (!stream || stream > pipe->pipe.streams)
+        return -1;
+    // The stream's ring is idle here, but it only holds one full TD.
+    if (xhci_td_len(data, datalen, pipe->pipe.maxpacket) != datalen)
+        return -1;
+    xhci_xfer_queue(pipe->srings[stream], pipe->pipe.maxpacket
+                    , data, datalen, pipe->epid & 1);
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid | (stream << 16));
+    return 0;
+}
+
+// Drop the transfers still queued on a stream.  The caller must make
+// sure the device will not start them (no command was sent for the
+// stream) and that no other stream of the endpoint is in flight.
+int
+xhci_stream_cancel(struct usb_pipe *p, u16 stream)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (!stream || stream > pipe->pipe.streams)
+        return -1;
+    struct xhci_ring *ring = pipe->srings[stream];
+    if (!xhci_ring_busy(ring))
+        return 0;
+    int cc = xhci_cmd_stop_endpoint(xhci, pipe->slotid, pipe->epid);
+    if (cc != CC_SUCCESS && cc != CC_CONTEXT_STATE_ERROR) {
+        dprintf(1, "%s: stop endpoint failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+    u32 deq = (u32)&ring->ring[ring->nidx];
+    deq |= XHCI_SCT_PRIMARY_TR | (ring->cs ? 1 : 0);
+    cc = xhci_cmd_set_tr_dequeue(xhci, pipe->slotid, pipe->epid, stream, deq);
     if (cc != CC_SUCCESS) {
-        dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+        dprintf(1, "%s: set dequeue failed (cc %d)\n", __func__, cc);
         return -1;
     }
+    ring->eidx = ring->nidx;
+    return 0;
+}
 
+// Wait for the transfers queued on a stream to complete.
+int
+xhci_stream_wait(struct usb_pipe *p, u16 stream, int datalen)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (!stream || stream > pipe->pipe.streams)
+        return -1;
+    int cc = xhci_event_wait(xhci, pipe->srings[stream]
+                             , usb_xfer_time(p, datalen));
+    if (cc != CC_SUCCESS && cc != CC_SHORT_PACKET) {
+        dprintf(1, "%s: xfer failed (stream %d, cc %d)\n", __func__
+                , stream, cc);
+        return -1;
+    }
     return 0;
 }
 
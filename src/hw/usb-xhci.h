@@ -14,6 +14,12 @@ struct usb_pipe *xhci_realloc_pipe(struct usbdevice_s *usbdev
                                    , struct usb_endpoint_descriptor *epdesc);
 int xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
+struct usb_pipe *xhci_alloc_stream_pipe(struct usbdevice_s *usbdev
+                                        , struct usb_endpoint_descriptor *epdesc
+                                        , int streams);
+int xhci_stream_queue(struct usb_pipe *p, u16 stream, void *data, int datalen);
+int xhci_stream_wait(struct usb_pipe *p, u16 stream, int datalen);
+int xhci_stream_cancel(struct usb_pipe *p, u16 stream);
 int xhci_poll_intr(struct usb_pipe *p, void *data);
 
 // --------------------------------------------------------------
@@ -101,6 +107,14 @@ struct xhci_epctx {
     u32 reserved_01[3];
 } PACKED;
 
+// stream context
+struct xhci_streamctx {
+    u32 deq_low;
+    u32 deq_high;
+    u32 edtla;
+    u32 reserved_01;
+} PACKED;
+
 // device context array element
 struct xhci_devlist {
     u32 ptr_low;
@@ -113,6 +113,16 @@ usb_free_pipe(struct usbdevice_s *usbdev, struct usb_pipe *pipe)
     usb_realloc_pipe(usbdev, pipe, NULL);
 }
 
+// Allocate a bulk pipe with usb3 bulk streams (xhci only).
+struct usb_pipe *
+usb_alloc_stream_pipe(struct usbdevice_s *usbdev
+                      , struct usb_endpoint_descriptor *epdesc, int streams)
+{
+    if (usbdev->hub->cntl->type != USB_TYPE_XHCI)
+        return NULL;
+    return xhci_alloc_stream_pipe(usbdev, epdesc, streams);
+}
+
 // Send a message to the default control pipe of a device.
 int
 usb_send_default_control(struct usb_pipe *pipe, const struct usb_ctrlrequest *req
@@ -129,6 +139,33 @@ usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
     return usb_send_pipe(pipe_fl, dir, NULL, data, datasize);
 }
 
+// Queue a transfer on one stream of a bulk stream pipe
+int
+usb_stream_queue(struct usb_pipe *pipe_fl, u16 stream, void *data, int datasize)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_stream_queue(pipe_fl, stream, data, datasize);
+}
+
+// Wait for the transfers queued on a stream to complete
+int
+usb_stream_wait(struct usb_pipe *pipe_fl, u16 stream, int datasize)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_stream_wait(pipe_fl, stream, datasize);
+}
+
+// Drop transfers that were queued on a stream but never started
+int
+usb_stream_cancel(struct usb_pipe *pipe_fl, u16 stream)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_stream_cancel(pipe_fl, stream);
+}
+
 // Check if a pipe for a given controller is on the freelist
 int
 usb_is_freelist(struct usb_s *cntl, struct usb_pipe *pipe)
@@ -16,6 +16,7 @@ struct usb_pipe {
     u8 speed;
     u16 maxpacket;
     u8 eptype;
+    u8 streams;
 };
 
 // Common information for usb devices.
@@ -212,6 +213,17 @@ struct usb_endpoint_descriptor {
 #define USB_ENDPOINT_XFER_INT           3
 #define USB_ENDPOINT_MAX_ADJUSTABLE     0x80
 
+struct usb_ss_ep_comp_descriptor {
+    u8  bLength;
+    u8  bDescriptorType;
+
+    u8  bMaxBurst;
+    u8  bmAttributes;
+    u16 wBytesPerInterval;
+} PACKED;
+
+#define USB_SS_EP_MAXSTREAMS_MASK       0x1f    /* in bmAttributes (bulk) */
+
 #define USB_CONTROL_SETUP_SIZE          8
 
 
@@ -237,6 +249,13 @@ int usb_32bit_pipe(struct usb_pipe *pipe_fl);
 struct usb_pipe *usb_alloc_pipe(struct usbdevice_s *usbdev
                                 , struct usb_endpoint_descriptor *epdesc);
 void usb_free_pipe(struct usbdevice_s *usbdev, struct usb_pipe *pipe);
+struct usb_pipe *usb_alloc_stream_pipe(struct usbdevice_s *usbdev
+                                       , struct usb_endpoint_descriptor *epdesc
+                                       , int streams);
+int usb_stream_queue(struct usb_pipe *pipe_fl, u16 stream
+                     , void *data, int datasize);
+int usb_stream_wait(struct usb_pipe *pipe_fl, u16 stream, int datasize);
+int usb_stream_cancel(struct usb_pipe *pipe_fl, u16 stream);
 int usb_send_default_control(struct usb_pipe *pipe
                              , const struct usb_ctrlrequest *req, void *data);
 int usb_is_freelist(struct usb_s *cntl, struct usb_pipe *pipe);
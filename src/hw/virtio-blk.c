@@ -18,7 +18,7 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep, bootprio_find_pci_device, is_bootprio_strict
+#include "util.h" // bootprio_find_pci_device, is_bootprio_strict
 #include "virtio-pci.h"
 #include "virtio-mmio.h"
 #include "virtio-ring.h"
@@ -29,95 +29,115 @@
 		typeof(b) _b = b;\
 		_a < _b ? _a : _b; })
 
+// Maximum number of requests queued on the vring by a single disk_op
+#define VIRTIO_BLK_MAX_INFLIGHT 16
+// Maximum number of data segments in an indirect request
+#define VIRTIO_BLK_MAX_SEGS 16
+
+struct virtio_blk_req {
+    struct virtio_blk_outhdr hdr;
+    u8 status;
+    /* indirect table: header, data segments and status */
+    struct vring_desc table[VIRTIO_BLK_MAX_SEGS + 2] __aligned(16);
+};
+
 struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
     struct vp_device vp;
+    struct virtio_blk_req *reqs;
+    u16 max_inflight;
 };
 
-void
-virtio_blk_op_one_segment(struct virtiodrive_s *vdrive,
-    int write, struct vring_list sg[])
-{
-    struct vring_virtqueue *vq = vdrive->vq;
-
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(&vdrive->vp, vq, 1);
-
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
-
-    /* Reclaim virtqueue element */
-        vring_get_buf(vq, NULL);
-
-    /**
-    ** Clear interrupt status register. Avoid leaving interrupts stuck
-    ** if VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
-    **/
-    vp_get_isr(&vdrive->vp);
-}
-
 static int
 virtio_blk_op(struct disk_op_s *op, int write)
 {
     struct virtiodrive_s *vdrive =
         container_of(op->drive_fl, struct virtiodrive_s, drive);
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
-    u32 max_io_size =
-        vdrive->drive.max_segment_size * vdrive->drive.max_segments;
+    struct vring_virtqueue *vq = vdrive->vq;
+    u32 blksize = vdrive->drive.blksize;
+    u32 max_segment_size = vdrive->drive.max_segment_size;
+    u32 max_io_size = max_segment_size * vdrive->drive.max_segments;
+    u32 seg_len_max = 0;
     u16 blk_num_max;
 
-    if (vdrive->drive.blksize != 0 && max_io_size != 0)
-        blk_num_max = (u16) min(max_io_size / vdrive->drive.blksize, 0xffff);
+    if (vdrive->vp.use_indirect && max_segment_size >= blksize) {
+        /* describe each request with several segments of size_max bytes */
+        u32 nsegs = vdrive->drive.max_segments ?: VIRTIO_BLK_MAX_SEGS;
+        seg_len_max = ALIGN_DOWN(max_segment_size, blksize);
+        max_io_size = seg_len_max * min(nsegs, VIRTIO_BLK_MAX_SEGS);
+    }
+
+    if (blksize != 0 && max_io_size != 0)
+        blk_num_max = (u16) min(max_io_size / blksize, 0xffff);
     else
         /* default blk_num_max if hardware doesnot advise a proper value */
         blk_num_max = 64;
-
-    if (op->count <= blk_num_max) {
-        virtio_blk_op_one_segment(vdrive, write, sg);
-    } else {
-        void *p  = op->buf_fl;
-        u16 count = op->count;
-
-        while (count > 0) {
+    if (!seg_len_max)
+        seg_len_max = blksize * blk_num_max;
+
+    void *p = op->buf_fl;
+    u64 sector = op->lba;
+    u16 count = op->count;
+    int ret = DISK_RET_SUCCESS;
+
+    while (count > 0 && ret == DISK_RET_SUCCESS) {
+        /* Queue as many requests as the ring allows before kicking host */
+        int i, num_added;
+        for (num_added = 0; count > 0 && num_added < vdrive->max_inflight;
+             num_added++) {
+            struct virtio_blk_req *req = &vdrive->reqs[num_added];
+            struct vring_list sg[VIRTIO_BLK_MAX_SEGS + 2];
             u16 blk_num = min(count, blk_num_max);
-            sg[1].length = vdrive->drive.blksize * blk_num;
-            sg[1].addr = p;
-            virtio_blk_op_one_segment(vdrive, write, sg);
-            if (status == VIRTIO_BLK_S_OK) {
-                hdr.sector += blk_num;
-                p += sg[1].length;
-                count -= blk_num;
-            } else {
-                break;
+            u32 len = blksize * blk_num;
+            int n = 0;
+
+            req->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            req->hdr.ioprio = 0;
+            req->hdr.sector = sector;
+            req->status = VIRTIO_BLK_S_UNSUPP;
+
+            sg[n].addr = (void*)(&req->hdr);
+            sg[n++].length = sizeof(req->hdr);
+            while (len) {
+                u32 seg_len = min(len, seg_len_max);
+                sg[n].addr = p;
+                sg[n++].length = seg_len;
+                p += seg_len;
+                len -= seg_len;
             }
+            sg[n].addr = (void*)(&req->status);
+            sg[n++].length = sizeof(req->status);
+
+            int out = write ? n - 1 : 1;
+            if (vdrive->vp.use_indirect)
+                vring_add_buf_indirect(vq, sg, out, n - out,
+                                       num_added, num_added, req->table);
+            else
+                vring_add_buf(vq, sg, out, n - out, num_added, num_added);
+
+            sector += blk_num;
+            count -= blk_num;
+        }
+        vring_kick(&vdrive->vp, vq, num_added);
+
+        /* Wait for all replies and reclaim virtqueue elements */
+        for (i = 0; i < num_added; i++) {
+            vring_wait_used(vq);
+            vring_get_buf(vq, NULL);
         }
+
+        /**
+        ** Clear interrupt status register. Avoid leaving interrupts stuck
+        ** if VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
+        **/
+        vp_get_isr(&vdrive->vp);
+
+        for (i = 0; i < num_added; i++)
+            if (vdrive->reqs[i].status != VIRTIO_BLK_S_OK)
+                ret = DISK_RET_EBADTRACK;
     }
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    return ret;
 }
 
 int
@@ -135,6 +155,24 @@ virtio_blk_process_op(struct disk_op_s *op)
     }
 }
 
+// Allocate the request headers used to queue several segments at once
+static int
+virtio_blk_alloc_reqs(struct virtiodrive_s *vdrive, int num)
+{
+    /* Each request uses three descriptors (header, data and status) or a
+     * single indirect one */
+    if (!vdrive->vp.use_indirect)
+        num /= 3;
+    u16 max_inflight = min(num, VIRTIO_BLK_MAX_INFLIGHT);
+    vdrive->reqs = malloc_high(sizeof(*vdrive->reqs) * max_inflight);
+    if (!vdrive->reqs) {
+        warn_noalloc();
+        return -1;
+    }
+    vdrive->max_inflight = max_inflight;
+    return 0;
+}
+
 static void
 init_virtio_blk(void *data)
 {
@@ -157,6 +195,10 @@ init_virtio_blk(void *data)
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
+        u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
+        u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
         u64 max_segments = 1ull << VIRTIO_BLK_F_SEG_MAX;
         u64 max_segment_size = 1ull << VIRTIO_BLK_F_SIZE_MAX;
@@ -166,8 +208,9 @@ init_virtio_blk(void *data)
             goto fail;
         }
 
-        features = features & (version1 | iommu_platform | blk_size
-                        | max_segments | max_segment_size);
+        features = features & (version1 | iommu_platform | packed | event_idx
+                        | notify_data | indirect | blk_size | max_segments
+                        | max_segment_size);
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -210,11 +253,15 @@ init_virtio_blk(void *data)
             vp_read(&vp->device, struct virtio_blk_config, sectors);
     }
 
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
+    int num = vp_find_vq(&vdrive->vp, 0, &vdrive->vq);
+    if (num < 0) {
         dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
         goto fail;
     }
 
+    if (virtio_blk_alloc_reqs(vdrive, num) < 0)
+        goto fail;
+
     if (!vdrive->vp.use_modern) {
         struct virtio_blk_config cfg;
         vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
@@ -256,6 +303,7 @@ init_virtio_blk(void *data)
 
 fail:
     vp_reset(&vdrive->vp);
+    free(vdrive->reqs);
     free(vdrive->vq);
     free(vdrive);
 }
@@ -279,12 +327,16 @@ init_virtio_blk_mmio(void *mmio)
     struct vp_device *vp = &vdrive->vp;
     u64 features = vp_get_features(vp);
     u64 version1 = 1ull << VIRTIO_F_VERSION_1;
+    u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+    u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
+    u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
+    u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
     u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
     u64 max_segments = 1ull << VIRTIO_BLK_F_SEG_MAX;
     u64 max_segment_size = 1ull << VIRTIO_BLK_F_SIZE_MAX;
 
-    features = features & (version1 | blk_size
-            | max_segments | max_segment_size);
+    features = features & (version1 | packed | event_idx | notify_data
+            | indirect | blk_size | max_segments | max_segment_size);
     vp_set_features(vp, features);
     status |= VIRTIO_CONFIG_S_FEATURES_OK;
     vp_set_status(vp, status);
@@ -293,11 +345,15 @@ init_virtio_blk_mmio(void *mmio)
         goto fail;
     }
 
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
+    int num = vp_find_vq(&vdrive->vp, 0, &vdrive->vq);
+    if (num < 0) {
         dprintf(1, "fail to find vq for virtio-blk-mmio %p\n", mmio);
         goto fail;
     }
 
+    if (virtio_blk_alloc_reqs(vdrive, num) < 0)
+        goto fail;
+
     if (features & max_segment_size)
         vdrive->drive.max_segment_size =
             vp_read(&vp->device, struct virtio_blk_config, size_max);
@@ -340,6 +396,7 @@ init_virtio_blk_mmio(void *mmio)
 
 fail:
     vp_reset(&vdrive->vp);
+    free(vdrive->reqs);
     free(vdrive->vq);
     free(vdrive);
 }
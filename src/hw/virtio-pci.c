@@ -227,6 +227,12 @@ void vp_set_features(struct vp_device *vp, u64 features)
     } else {
         vp_write(&vp->legacy, virtio_pci_legacy, guest_features, f0);
     }
+
+    /* queues created from now on use the negotiated ring layout */
+    vp->use_packed = !!(features & (1ull << VIRTIO_F_RING_PACKED));
+    vp->use_event_idx = !!(features & (1ull << VIRTIO_RING_F_EVENT_IDX));
+    vp->use_notify_data = !!(features & (1ull << VIRTIO_F_NOTIFICATION_DATA));
+    vp->use_indirect = !!(features & (1ull << VIRTIO_RING_F_INDIRECT_DESC));
 }
 
 u8 vp_get_status(struct vp_device *vp)
@@ -280,16 +286,34 @@ void vp_reset(struct vp_device *vp)
 
 void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq)
 {
+    u32 data = vq->queue_index;
+    if (vp->use_notify_data) {
+        /* Tell the device where the next available buffer will go. */
+        if (vq->packed)
+            data |= ((u32)vq->avail_wrap_counter << 31
+                     | (u32)vq->next_avail_idx << 16);
+        else
+            data |= (u32)vq->vring.avail->idx << 16;
+    }
+    u8 size = vp->use_notify_data ? 4 : 2;
+    vp->notify_count++;
+
     if (vp->use_mmio) {
-        vp_write(&vp->common, virtio_mmio_cfg, queue_notify, vq->queue_index);
+        vp_write(&vp->common, virtio_mmio_cfg, queue_notify, data);
     } else if (vp->use_modern) {
         u32 offset = vq->queue_notify_off * vp->notify_off_multiplier;
         switch (vp->notify.mode) {
         case VP_ACCESS_IO:
-            outw(vq->queue_index, vp->notify.ioaddr + offset);
+            if (size == 4)
+                outl(data, vp->notify.ioaddr + offset);
+            else
+                outw(data, vp->notify.ioaddr + offset);
             break;
         case VP_ACCESS_MMIO:
-            writew(vp->notify.memaddr + offset, vq->queue_index);
+            if (size == 4)
+                writel(vp->notify.memaddr + offset, data);
+            else
+                writew(vp->notify.memaddr + offset, data);
             break;
         case VP_ACCESS_PCICFG:
             pci_config_writeb(vp->notify.bdf, vp->notify.cfg +
@@ -300,13 +324,18 @@ void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq)
                               vp->notify.baroff + offset);
             pci_config_writel(vp->notify.bdf, vp->notify.cfg +
                               offsetof(struct virtio_pci_cfg_cap, cap.length),
-                              2);
-            pci_config_writew(vp->notify.bdf, vp->notify.cfg +
-                              offsetof(struct virtio_pci_cfg_cap, pci_cfg_data),
-                              vq->queue_index);
+                              size);
+            if (size == 4)
+                pci_config_writel(vp->notify.bdf, vp->notify.cfg +
+                                  offsetof(struct virtio_pci_cfg_cap,
+                                           pci_cfg_data), data);
+            else
+                pci_config_writew(vp->notify.bdf, vp->notify.cfg +
+                                  offsetof(struct virtio_pci_cfg_cap,
+                                           pci_cfg_data), data);
         }
-        dprintf(9, "vp notify %x (%d) -- 0x%x\n",
-                vp->notify.ioaddr, 2, vq->queue_index);
+        dprintf(9, "vp notify %x (%d) -- 0x%x [%d]\n",
+                vp->notify.ioaddr, size, data, vp->notify_count);
     } else {
         vp_write(&vp->legacy, virtio_pci_legacy, queue_notify, vq->queue_index);
     }
@@ -375,26 +404,48 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
        }
    }
    vq->queue_index = queue_index;
+   vq->event_idx = vp->use_event_idx;
 
    /* initialize the queue */
    struct vring * vr = &vq->vring;
-   vring_init(vr, num, (unsigned char*)&vq->queue);
+   void *desc, *avail, *used;
+   if (vp->use_packed) {
+       struct vring_packed *pvr = &vq->packed_vring;
+       vring_init_packed(pvr, num, (unsigned char*)&vq->queue);
+       vq->packed = 1;
+       /* buffer ids come from a free list, as chains complete out of order */
+       int i;
+       for (i = 0; i < num - 1; i++)
+           vq->id_next[i] = i + 1;
+       vq->free_head = 0;
+       vq->avail_wrap_counter = 1;
+       vq->used_wrap_counter = 1;
+       desc = pvr->desc;
+       avail = pvr->driver;
+       used = pvr->device;
+   } else {
+       vring_init(vr, num, (unsigned char*)&vq->queue);
+       desc = vr->desc;
+       avail = vr->avail;
+       used = vr->used;
+   }
 
    /* activate the queue
     *
-    * NOTE: vr->desc is initialized by vring_init()
+    * NOTE: desc/avail/used are the descriptor, driver and device areas;
+    * the packed ring can't be used by legacy devices.
     */
 
    if (vp->use_mmio) {
        if (vp_read(&vp->common, virtio_mmio_cfg, version) == 2) {
            vp_write(&vp->common, virtio_mmio_cfg, queue_desc_lo,
-                    (unsigned long)virt_to_phys(vr->desc));
+                    (unsigned long)virt_to_phys(desc));
            vp_write(&vp->common, virtio_mmio_cfg, queue_desc_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_driver_lo,
-                    (unsigned long)virt_to_phys(vr->avail));
+                    (unsigned long)virt_to_phys(avail));
            vp_write(&vp->common, virtio_mmio_cfg, queue_driver_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_device_lo,
-                    (unsigned long)virt_to_phys(vr->used));
+                    (unsigned long)virt_to_phys(used));
            vp_write(&vp->common, virtio_mmio_cfg, queue_device_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_ready, 1);
        } else {
@@ -405,13 +456,13 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
        }
    } else if (vp->use_modern) {
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_lo,
-                (unsigned long)virt_to_phys(vr->desc));
+                (unsigned long)virt_to_phys(desc));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_lo,
-                (unsigned long)virt_to_phys(vr->avail));
+                (unsigned long)virt_to_phys(avail));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_lo,
-                (unsigned long)virt_to_phys(vr->used));
+                (unsigned long)virt_to_phys(used));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_enable, 1);
        vq->queue_notify_off = vp_read(&vp->common, virtio_pci_common_cfg,
@@ -428,6 +479,44 @@ fail:
    return -1;
 }
 
+// Determine how a virtio structure located in the given bar is accessed
+static u8 vp_bar_mode(struct pci_device *pci, u8 bar, u64 *paddr)
+{
+    u32 base = PCI_BASE_ADDRESS_0 + 4 * bar;
+    u64 addr = pci_config_readl(pci->bdf, base);
+    u8 mode;
+
+    if (addr & PCI_BASE_ADDRESS_SPACE_IO) {
+        addr &= PCI_BASE_ADDRESS_IO_MASK;
+        mode = VP_ACCESS_IO;
+    } else if ((addr & PCI_BASE_ADDRESS_MEM_TYPE_MASK) ==
+               PCI_BASE_ADDRESS_MEM_TYPE_64) {
+        addr &= PCI_BASE_ADDRESS_MEM_MASK;
+        addr |= (u64)pci_config_readl(pci->bdf, base + 4) << 32;
+        mode = (addr > 0xffffffffll) ? VP_ACCESS_PCICFG : VP_ACCESS_MMIO;
+    } else {
+        addr &= PCI_BASE_ADDRESS_MEM_MASK;
+        mode = VP_ACCESS_MMIO;
+    }
+    *paddr = addr;
+    return mode;
+}
+
+// Order notify access modes by cost.  A mmio doorbell can be handled by
+// the hypervisor's fast path, port io always exits, and pci cfg access
+// needs several port io accesses per notify.
+static int vp_notify_rank(u8 mode)
+{
+    switch (mode) {
+    case VP_ACCESS_MMIO:
+        return 0;
+    case VP_ACCESS_IO:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
 void vp_init_simple(struct vp_device *vp, struct pci_device *pci)
 {
     u8 cap = pci_find_capability(pci->bdf, PCI_CAP_ID_VNDR, 0);
@@ -435,7 +524,7 @@ void vp_init_simple(struct vp_device *vp, struct pci_device *pci)
     const char *mode;
     u32 offset, base, mul;
     u64 addr;
-    u8 type;
+    u8 type, bar;
 
     memset(vp, 0, sizeof(*vp));
     while (cap != 0) {
@@ -447,6 +536,15 @@ void vp_init_simple(struct vp_device *vp, struct pci_device *pci)
             break;
         case VIRTIO_PCI_CAP_NOTIFY_CFG:
             vp_cap = &vp->notify;
+            bar = pci_config_readb(pci->bdf, cap +
+                                   offsetof(struct virtio_pci_cap, bar));
+            if (vp_cap->cap && (vp_notify_rank(vp_bar_mode(pci, bar, &addr))
+                                >= vp_notify_rank(vp_cap->mode))) {
+                // Keep the cheaper notify capability found earlier
+                vp_cap = NULL;
+                break;
+            }
+            vp_cap->cap = 0;
             mul = offsetof(struct virtio_pci_notify_cap, notify_off_multiplier);
             vp->notify_off_multiplier = pci_config_readl(pci->bdf, cap + mul);
             break;
@@ -480,20 +578,7 @@ void vp_init_simple(struct vp_device *vp, struct pci_device *pci)
             offset = pci_config_readl(pci->bdf, cap +
                                       offsetof(struct virtio_pci_cap, offset));
             base = PCI_BASE_ADDRESS_0 + 4 * vp_cap->bar;
-            addr = pci_config_readl(pci->bdf, base);
-            if (addr & PCI_BASE_ADDRESS_SPACE_IO) {
-                addr &= PCI_BASE_ADDRESS_IO_MASK;
-                vp_cap->mode = VP_ACCESS_IO;
-            } else if ((addr & PCI_BASE_ADDRESS_MEM_TYPE_MASK) ==
-                       PCI_BASE_ADDRESS_MEM_TYPE_64) {
-                addr &= PCI_BASE_ADDRESS_MEM_MASK;
-                addr |= (u64)pci_config_readl(pci->bdf, base + 4) << 32;
-                vp_cap->mode = (addr > 0xffffffffll) ?
-                    VP_ACCESS_PCICFG : VP_ACCESS_MMIO;
-            } else {
-                addr &= PCI_BASE_ADDRESS_MEM_MASK;
-                vp_cap->mode = VP_ACCESS_MMIO;
-            }
+            vp_cap->mode = vp_bar_mode(pci, vp_cap->bar, &addr);
             switch (vp_cap->mode) {
             case VP_ACCESS_IO:
             {
@@ -112,6 +112,11 @@ struct vp_device {
     u32 notify_off_multiplier;
     u8 use_modern;
     u8 use_mmio;
+    u8 use_packed;
+    u8 use_event_idx;
+    u8 use_notify_data;
+    u8 use_indirect;
+    u32 notify_count;
 };
 
 u64 _vp_read(struct vp_cap *cap, u32 offset, u8 size);
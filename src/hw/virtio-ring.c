@@ -17,6 +17,7 @@
  */
 
 #include "output.h" // panic
+#include "util.h" // usleep
 #include "virtio-ring.h"
 #include "virtio-pci.h"
 
@@ -34,6 +35,16 @@
 
 int vring_more_used(struct vring_virtqueue *vq)
 {
+    if (vq->packed) {
+        u16 flags = vq->packed_vring.desc[vq->last_used_idx].flags;
+        int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+        int used = !!(flags & VRING_PACKED_DESC_F_USED);
+        int more = avail == used && used == vq->used_wrap_counter;
+        /* Make sure descriptor reads are done after flags read above. */
+        smp_rmb();
+        return more;
+    }
+
     struct vring_used *used = vq->vring.used;
     int more = vq->last_used_idx != used->idx;
     /* Make sure ring reads are done after idx read above. */
@@ -41,6 +52,33 @@ int vring_more_used(struct vring_virtqueue *vq)
     return more;
 }
 
+/*
+ * vring_wait_used
+ *
+ * wait for a used buffer.  Requests usually complete quickly, so spin
+ * on the ring first (which doesn't exit to the hypervisor, unlike
+ * reading the timer) and only then back off with increasing sleeps.
+ *
+ */
+
+#define VRING_POLL_MAX_USEC  64
+
+void vring_wait_used(struct vring_virtqueue *vq)
+{
+    u32 spin, delay = 1;
+
+    for (spin = 0; spin < VRING_POLL_SPIN; spin++) {
+        if (vring_more_used(vq))
+            return;
+        cpu_relax();
+    }
+    while (!vring_more_used(vq)) {
+        usleep(delay);
+        if (delay < VRING_POLL_MAX_USEC)
+            delay <<= 1;
+    }
+}
+
 /*
  * vring_free
  *
@@ -72,8 +110,34 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
  *
  */
 
+static int vring_packed_get_buf(struct vring_virtqueue *vq, unsigned int *len)
+{
+    struct vring_packed *vr = &vq->packed_vring;
+    struct vring_packed_desc *desc = &vr->desc[vq->last_used_idx];
+    u16 id = desc->id;
+
+    if (len != NULL)
+        *len = desc->len;
+
+    /* skip over all descriptors of the chain identified by id */
+    vq->last_used_idx += vq->desc_num[id];
+    if (vq->last_used_idx >= vr->num) {
+        vq->last_used_idx -= vr->num;
+        vq->used_wrap_counter ^= 1;
+    }
+
+    /* return the buffer id to the free list */
+    vq->id_next[id] = vq->free_head;
+    vq->free_head = id;
+
+    return vq->vdata[id];
+}
+
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 {
+    if (vq->packed)
+        return vring_packed_get_buf(vq, len);
+
     struct vring *vr = &vq->vring;
     struct vring_used_elem *elem;
     struct vring_used *used = vq->vring.used;
@@ -96,10 +160,66 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
     return ret;
 }
 
-void vring_add_buf(struct vring_virtqueue *vq,
-                   struct vring_list list[],
-                   unsigned int out, unsigned int in,
-                   int index, int num_added)
+/*
+ * vring_packed_add_buf
+ *
+ * Descriptors of a chain are written in ring order.  The chain is
+ * identified by a buffer id from the free id list - not by its ring
+ * position, which a later chain may reuse while this one is still
+ * outstanding.  The head flags are written last so the device never
+ * sees a partially built chain.
+ */
+
+static void vring_packed_add_buf(struct vring_virtqueue *vq,
+                                 struct vring_list list[],
+                                 unsigned int out, unsigned int in,
+                                 int index, u16 extra_flags)
+{
+    struct vring_packed *vr = &vq->packed_vring;
+    struct vring_packed_desc *desc = vr->desc;
+    unsigned int n, total = out + in;
+    u16 head = vq->next_avail_idx, i = head, head_flags = 0;
+    u16 id = vq->free_head;
+    u8 wrap = vq->avail_wrap_counter;
+
+    BUG_ON(total == 0);
+    vq->free_head = vq->id_next[id];
+
+    for (n = 0; n < total; n++, list++) {
+        u16 flags = extra_flags | ((n < out) ? 0 : VRING_DESC_F_WRITE);
+        if (n + 1 < total)
+            flags |= VRING_DESC_F_NEXT;
+        flags |= wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+
+        desc[i].addr = (u64)virt_to_phys(list->addr);
+        desc[i].len = list->length;
+        desc[i].id = id;
+        if (i == head)
+            head_flags = flags;
+        else
+            desc[i].flags = flags;
+
+        if (++i >= vr->num) {
+            i = 0;
+            wrap ^= 1;
+        }
+    }
+
+    vq->next_avail_idx = i;
+    vq->avail_wrap_counter = wrap;
+    vq->num_added += total;
+    vq->vdata[id] = index;
+    vq->desc_num[id] = total;
+
+    /* Make sure the chain is written before the head is made available. */
+    smp_wmb();
+    desc[head].flags = head_flags;
+}
+
+static void vring_split_add_buf(struct vring_virtqueue *vq,
+                                struct vring_list list[],
+                                unsigned int out, unsigned int in,
+                                int index, int num_added, u16 extra_flags)
 {
     struct vring *vr = &vq->vring;
     int i, av, head, prev;
@@ -111,14 +231,14 @@ void vring_add_buf(struct vring_virtqueue *vq,
     prev = 0;
     head = vq->free_head;
     for (i = head; out; i = desc[i].next, out--) {
-        desc[i].flags = VRING_DESC_F_NEXT;
+        desc[i].flags = extra_flags | VRING_DESC_F_NEXT;
         desc[i].addr = (u64)virt_to_phys(list->addr);
         desc[i].len = list->length;
         prev = i;
         list++;
     }
     for ( ; in; i = desc[i].next, in--) {
-        desc[i].flags = VRING_DESC_F_NEXT|VRING_DESC_F_WRITE;
+        desc[i].flags = extra_flags | VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
         desc[i].addr = (u64)virt_to_phys(list->addr);
         desc[i].len = list->length;
         prev = i;
@@ -134,14 +254,115 @@ void vring_add_buf(struct vring_virtqueue *vq,
     avail->ring[av] = head;
 }
 
+void vring_add_buf(struct vring_virtqueue *vq,
+                   struct vring_list list[],
+                   unsigned int out, unsigned int in,
+                   int index, int num_added)
+{
+    if (vq->packed)
+        vring_packed_add_buf(vq, list, out, in, index, 0);
+    else
+        vring_split_add_buf(vq, list, out, in, index, num_added, 0);
+}
+
+/*
+ * vring_add_buf_indirect
+ *
+ * like vring_add_buf, but the chain is described in the caller supplied
+ * table (out + in entries, 16 byte aligned) so it takes a single ring slot
+ *
+ */
+
+void vring_add_buf_indirect(struct vring_virtqueue *vq,
+                            struct vring_list list[],
+                            unsigned int out, unsigned int in,
+                            int index, int num_added, void *table)
+{
+    unsigned int i, total = out + in;
+
+    BUG_ON(total == 0);
+
+    if (vq->packed) {
+        struct vring_packed_desc *desc = table;
+        for (i = 0; i < total; i++, list++) {
+            desc[i].addr = (u64)virt_to_phys(list->addr);
+            desc[i].len = list->length;
+            desc[i].id = 0;
+            desc[i].flags = (i < out) ? 0 : VRING_DESC_F_WRITE;
+        }
+    } else {
+        struct vring_desc *desc = table;
+        for (i = 0; i < total; i++, list++) {
+            desc[i].addr = (u64)virt_to_phys(list->addr);
+            desc[i].len = list->length;
+            desc[i].flags = (i < out) ? 0 : VRING_DESC_F_WRITE;
+            if (i + 1 < total)
+                desc[i].flags |= VRING_DESC_F_NEXT;
+            desc[i].next = i + 1;
+        }
+    }
+
+    struct vring_list entry = {
+        .addr   = table,
+        .length = total * sizeof(struct vring_desc),
+    };
+    if (vq->packed)
+        vring_packed_add_buf(vq, &entry, 1, 0, index, VRING_DESC_F_INDIRECT);
+    else
+        vring_split_add_buf(vq, &entry, 1, 0, index, num_added,
+                            VRING_DESC_F_INDIRECT);
+}
+
+/*
+ * vring_packed_need_kick
+ *
+ * check the device event suppression area to see whether the device
+ * wants to be notified about the descriptors added since the last kick
+ *
+ */
+
+static int vring_packed_need_kick(struct vring_virtqueue *vq)
+{
+    struct vring_packed *vr = &vq->packed_vring;
+    u16 new = vq->next_avail_idx, old = new - vq->num_added;
+    u16 flags = vr->device->flags;
+
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+    u16 off_wrap = vr->device->off_wrap;
+    u16 event = off_wrap & ~(1 << 15);
+    if ((off_wrap >> 15) != vq->avail_wrap_counter)
+        event -= vr->num;
+    return vring_need_event(event, new, old);
+}
+
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 {
-    struct vring *vr = &vq->vring;
-    struct vring_avail *avail = vr->avail;
+    int kick;
 
-    /* Make sure idx update is done after ring write. */
-    smp_wmb();
-    avail->idx = avail->idx + num_added;
+    if (vq->packed) {
+        /* Make sure descriptors are visible before reading event area. */
+        smp_mb();
+        kick = vring_packed_need_kick(vq);
+        vq->num_added = 0;
+    } else {
+        struct vring *vr = &vq->vring;
+        struct vring_avail *avail = vr->avail;
+        u16 old = avail->idx, new = old + num_added;
+
+        /* Make sure idx update is done after ring write. */
+        smp_wmb();
+        avail->idx = new;
+
+        /* Make sure idx update is visible before reading event index. */
+        smp_mb();
+        if (vq->event_idx)
+            kick = vring_need_event(vring_avail_event(vr), new, old);
+        else
+            kick = !(vr->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
 
-    vp_notify(vp, vq);
+    if (kick)
+        vp_notify(vp, vq);
 }
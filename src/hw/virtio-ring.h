@@ -19,16 +19,37 @@
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1              32
 #define VIRTIO_F_IOMMU_PLATFORM         33
+/* We support indirect buffer descriptors */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+/* The Guest publishes the used index for which it expects an interrupt
+ * at the end of the avail ring. Host should ignore the avail->flags field.
+ * The Host publishes the avail index for which it expects a kick
+ * at the end of the used ring. Guest should ignore the used->flags field. */
+#define VIRTIO_RING_F_EVENT_IDX         29
+/* Packed virtqueue layout (virtio 1.1). */
+#define VIRTIO_F_RING_PACKED            34
+/* Driver passes extra data (next avail position) in its notifications. */
+#define VIRTIO_F_NOTIFICATION_DATA      38
 
 #define MAX_QUEUE_NUM      (256)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
 #define VRING_USED_F_NO_NOTIFY     1
 
+/* Packed ring descriptor ownership flags */
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+
+/* Packed ring event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+
 struct vring_desc
 {
    u64 addr;
@@ -64,10 +85,36 @@ struct vring {
    struct vring_used *used;
 };
 
+struct vring_packed_desc
+{
+   u64 addr;
+   u32 len;
+   u16 id;
+   u16 flags;
+};
+
+struct vring_packed_desc_event
+{
+   u16 off_wrap;
+   u16 flags;
+};
+
+struct vring_packed {
+   unsigned int num;
+   struct vring_packed_desc *desc;
+   struct vring_packed_desc_event *driver;
+   struct vring_packed_desc_event *device;
+};
+
 #define vring_size(num) \
     (ALIGN(sizeof(struct vring_desc) * num + sizeof(struct vring_avail) \
-           + sizeof(u16) * num, PAGE_SIZE)                              \
-     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num)
+           + sizeof(u16) * (num + 1), PAGE_SIZE)                        \
+     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num \
+     + sizeof(u16))
+
+/* Event index fields trail the avail and used rings */
+#define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
+#define vring_avail_event(vr) (*(u16 *)&(vr)->used->ring[(vr)->num])
 
 typedef unsigned char virtio_queue_t[vring_size(MAX_QUEUE_NUM)];
 
@@ -77,6 +124,16 @@ struct vring_virtqueue {
    u16 free_head;
    u16 last_used_idx;
    u16 vdata[MAX_QUEUE_NUM];
+   u8 event_idx;
+   /* Packed ring */
+   struct vring_packed packed_vring;
+   u8 packed;
+   u8 avail_wrap_counter;
+   u8 used_wrap_counter;
+   u16 next_avail_idx;
+   u16 num_added;
+   u16 desc_num[MAX_QUEUE_NUM];
+   u16 id_next[MAX_QUEUE_NUM];  /* free buffer id list (from free_head) */
    /* PCI */
    int queue_index;
    int queue_notify_off;
@@ -101,7 +158,8 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
    vr->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 
    /* physical address of used must be page aligned */
-   vr->used = (void*)ALIGN((u32)&vr->avail->ring[num], PAGE_SIZE);
+   vr->used = (void*)ALIGN((u32)&vring_used_event(vr) + sizeof(u16),
+                           PAGE_SIZE);
 
    int i;
    for (i = 0; i < num - 1; i++)
@@ -109,13 +167,45 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
    vr->desc[i].next = 0;
 }
 
+/* Is the event index between old (exclusive) and new (inclusive)? */
+static inline int
+vring_need_event(u16 event_idx, u16 new_idx, u16 old)
+{
+   return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old);
+}
+
+/* The packed ring is laid out in the same storage as the split ring */
+static inline void
+vring_init_packed(struct vring_packed *vr, unsigned int num,
+                  unsigned char *queue)
+{
+   ASSERT32FLAT();
+   vr->num = num;
+
+   /* physical address of desc must be page aligned */
+   vr->desc = (void*)ALIGN((u32)queue, PAGE_SIZE);
+
+   vr->driver = (struct vring_packed_desc_event *)&vr->desc[num];
+   vr->device = vr->driver + 1;
+   /* disable interrupts */
+   vr->driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+}
+
+// Number of times to poll the ring before backing off to sleeps
+#define VRING_POLL_SPIN 1024
+
 struct vp_device;
 int vring_more_used(struct vring_virtqueue *vq);
+void vring_wait_used(struct vring_virtqueue *vq);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len);
 void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added);
+void vring_add_buf_indirect(struct vring_virtqueue *vq,
+                            struct vring_list list[],
+                            unsigned int out, unsigned int in,
+                            int index, int num_added, void *table);
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added);
 
 #endif /* _VIRTIO_RING_H_ */
@@ -18,12 +18,23 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep, bootprio_find_pci_device, is_bootprio_strict
+#include "util.h" // bootprio_find_pci_device, is_bootprio_strict
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-scsi.h"
 #include "virtio-mmio.h"
 
+// Maximum number of requests queued on the vring by a single disk_op
+#define VIRTIO_SCSI_MAX_INFLIGHT 8
+// Number of targets probed at once
+#define VIRTIO_SCSI_SCAN_THREADS 8
+
+struct virtio_scsi_req {
+    struct virtio_scsi_req_cmd cmd;
+    struct virtio_scsi_resp_cmd resp;
+    u8 done;
+};
+
 struct virtio_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
@@ -31,10 +42,67 @@ struct virtio_lun_s {
     char name[16];
     struct vring_virtqueue *vq;
     struct vp_device *vp;
+    // Requests on the vring of the adapter, indexed by vring buffer id
+    struct virtio_scsi_req **slots;
+    u16 nslots;
+    // Request headers used by this lun
+    struct virtio_scsi_req *reqs;
+    u16 max_inflight;
     u16 target;
     u16 lun;
 };
 
+// Mark the request behind the next used buffer as done
+static void
+virtio_scsi_reap(struct virtio_lun_s *vlun)
+{
+    int id = vring_get_buf(vlun->vq, NULL);
+    struct virtio_scsi_req *req = vlun->slots[id];
+    vlun->slots[id] = NULL;
+    req->done = 1;
+}
+
+// Reserve a vring buffer id for each of @count requests.  Several
+// threads may share the vring while targets are scanned, so completions
+// are reaped by whichever thread finds them.
+static void
+virtio_scsi_get_slots(struct virtio_lun_s *vlun, u16 *ids, int count)
+{
+    int i = 0, id = 0;
+    while (i < count) {
+        if (!vlun->slots[id]) {
+            vlun->reqs[i].done = 0;
+            vlun->slots[id] = &vlun->reqs[i];
+            ids[i++] = id;
+        } else if (++id >= vlun->nslots) {
+            id = 0;
+            if (vring_more_used(vlun->vq))
+                virtio_scsi_reap(vlun);
+            else
+                yield();
+        }
+    }
+}
+
+// Wait for the first @count requests of the lun to complete
+static void
+virtio_scsi_wait(struct virtio_lun_s *vlun, int count)
+{
+    u32 spin = 0;
+    int i = 0;
+    while (i < count) {
+        if (vlun->reqs[i].done) {
+            i++;
+        } else if (vring_more_used(vlun->vq)) {
+            virtio_scsi_reap(vlun);
+        } else if (++spin < VRING_POLL_SPIN) {
+            cpu_relax();
+        } else {
+            yield();
+        }
+    }
+}
+
 int
 virtio_scsi_process_op(struct disk_op_s *op)
 {
@@ -44,77 +112,95 @@ virtio_scsi_process_op(struct disk_op_s *op)
         container_of(op->drive_fl, struct virtio_lun_s, drive);
     struct vp_device *vp = vlun->vp;
     struct vring_virtqueue *vq = vlun->vq;
-    struct virtio_scsi_req_cmd req;
-    struct virtio_scsi_resp_cmd resp;
-    struct vring_list sg[3];
-
-    memset(&req, 0, sizeof(req));
-    int blocksize = scsi_fill_cmd(op, req.cdb, 16);
-    if (blocksize < 0)
-        return default_process_op(op);
-    req.lun[0] = 1;
-    req.lun[1] = vlun->target;
-    req.lun[2] = (vlun->lun >> 8) | 0x40;
-    req.lun[3] = (vlun->lun & 0xff);
-
-    u32 len = op->count * blocksize;
     int datain = scsi_is_read(op);
     int in_num = (datain ? 2 : 1);
-    int out_num = (len ? 3 : 2) - in_num;
 
-    sg[0].addr   = (void*)(&req);
-    sg[0].length = sizeof(req);
+    /* Split large reads and writes into several requests that the host
+     * can work on in parallel */
+    struct disk_op_s subop;
+    int nreqs = scsi_split_init(op, &subop, vlun->max_inflight);
+
+    /* Get all buffer ids first - this may yield, and a half built batch
+     * must not be left on the ring for another thread to kick */
+    u16 ids[VIRTIO_SCSI_MAX_INFLIGHT];
+    virtio_scsi_get_slots(vlun, ids, nreqs);
+
+    int num_added = 0, blocksize;
+    do {
+        struct virtio_scsi_req *req = &vlun->reqs[num_added];
+        struct vring_list sg[3];
+
+        memset(&req->cmd, 0, sizeof(req->cmd));
+        blocksize = scsi_fill_cmd(&subop, req->cmd.cdb, 16);
+        if (blocksize < 0) {
+            int i;
+            for (i = 0; i < nreqs; i++)
+                vlun->slots[ids[i]] = NULL;
+            return default_process_op(op);
+        }
+        req->cmd.lun[0] = 1;
+        req->cmd.lun[1] = vlun->target;
+        req->cmd.lun[2] = (vlun->lun >> 8) | 0x40;
+        req->cmd.lun[3] = (vlun->lun & 0xff);
+        req->resp.response = VIRTIO_SCSI_S_FAILURE;
 
-    sg[out_num].addr   = (void*)(&resp);
-    sg[out_num].length = sizeof(resp);
+        u32 len = subop.count * blocksize;
+        int out_num = (len ? 3 : 2) - in_num;
 
-    if (len) {
-        int data_idx = (datain ? 2 : 1);
-        sg[data_idx].addr   = op->buf_fl;
-        sg[data_idx].length = len;
-    }
+        sg[0].addr   = (void*)(&req->cmd);
+        sg[0].length = sizeof(req->cmd);
+
+        sg[out_num].addr   = (void*)(&req->resp);
+        sg[out_num].length = sizeof(req->resp);
+
+        if (len) {
+            int data_idx = (datain ? 2 : 1);
+            sg[data_idx].addr   = subop.buf_fl;
+            sg[data_idx].length = len;
+        }
 
-    /* Add to virtqueue and kick host */
-    vring_add_buf(vq, sg, out_num, in_num, 0, 0);
-    vring_kick(vp, vq, 1);
+        vring_add_buf(vq, sg, out_num, in_num, ids[num_added], num_added);
+        num_added++;
+    } while (scsi_split_next(op, &subop, vlun->max_inflight, blocksize));
 
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+    /* Kick host once for the whole batch */
+    vring_kick(vp, vq, num_added);
 
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
+    /* Wait for all replies */
+    virtio_scsi_wait(vlun, num_added);
 
     /* Clear interrupt status register.  Avoid leaving interrupts stuck if
      * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
      */
     vp_get_isr(vp);
 
-    if (resp.response == VIRTIO_SCSI_S_OK && resp.status == 0) {
-        return DISK_RET_SUCCESS;
+    int i, ret = DISK_RET_SUCCESS;
+    for (i = 0; i < num_added; i++) {
+        struct virtio_scsi_resp_cmd *resp = &vlun->reqs[i].resp;
+        if (resp->response != VIRTIO_SCSI_S_OK || resp->status != 0)
+            ret = DISK_RET_EBADTRACK;
     }
-    return DISK_RET_EBADTRACK;
+    return ret;
 }
 
+// Set up a lun of the adapter described by @tmpl_vlun
 static void
-virtio_scsi_init_lun(struct virtio_lun_s *vlun,
-                     struct pci_device *pci, void *mmio,
-                     struct vp_device *vp, struct vring_virtqueue *vq,
+virtio_scsi_init_lun(struct virtio_lun_s *vlun, struct virtio_lun_s *tmpl_vlun,
                      u16 target, u16 lun)
 {
     memset(vlun, 0, sizeof(*vlun));
     vlun->drive.type = DTYPE_VIRTIO_SCSI;
-    vlun->drive.cntl_id = pci->bdf;
-    vlun->pci = pci;
-    vlun->mmio = mmio;
-    vlun->vp = vp;
-    vlun->vq = vq;
+    vlun->drive.cntl_id = tmpl_vlun->drive.cntl_id;
+    vlun->pci = tmpl_vlun->pci;
+    vlun->mmio = tmpl_vlun->mmio;
+    memcpy(vlun->name, tmpl_vlun->name, sizeof(vlun->name));
+    vlun->vp = tmpl_vlun->vp;
+    vlun->vq = tmpl_vlun->vq;
+    vlun->slots = tmpl_vlun->slots;
+    vlun->nslots = tmpl_vlun->nslots;
+    vlun->max_inflight = tmpl_vlun->max_inflight;
     vlun->target = target;
     vlun->lun = lun;
-    if (vlun->pci)
-        snprintf(vlun->name, sizeof(vlun->name), "pci:%pP", vlun->pci);
-    if (vlun->mmio)
-        snprintf(vlun->name, sizeof(vlun->name), "mmio:%08x", (u32)vlun->mmio);
 }
 
 static int
@@ -142,8 +228,12 @@ virtio_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
         warn_noalloc();
         return -1;
     }
-    virtio_scsi_init_lun(vlun, tmpl_vlun->pci, tmpl_vlun->mmio,tmpl_vlun->vp,
-                         tmpl_vlun->vq, tmpl_vlun->target, lun);
+    virtio_scsi_init_lun(vlun, tmpl_vlun, tmpl_vlun->target, lun);
+    vlun->reqs = malloc_high(sizeof(*vlun->reqs) * vlun->max_inflight);
+    if (!vlun->reqs) {
+        warn_noalloc();
+        goto fail;
+    }
 
     if (vlun->pci)
         boot_lchs_find_scsi_device(vlun->pci, vlun->target, vlun->lun,
@@ -154,21 +244,89 @@ virtio_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
     return 0;
 
 fail:
+    free(vlun->reqs);
     free(vlun);
     return -1;
 }
 
 static int
-virtio_scsi_scan_target(struct pci_device *pci, void *mmio, struct vp_device *vp,
-                        struct vring_virtqueue *vq, u16 target)
+virtio_scsi_scan_target(void *hba, u32 target)
 {
-
+    struct virtio_lun_s *tmpl_vlun = hba;
     struct virtio_lun_s vlun0;
 
-    virtio_scsi_init_lun(&vlun0, pci, mmio, vp, vq, target, 0);
+    // Each scanning thread gets its own request headers
+    virtio_scsi_init_lun(&vlun0, tmpl_vlun, target, 0);
+    vlun0.reqs = malloc_tmp(sizeof(*vlun0.reqs) * vlun0.max_inflight);
+    if (!vlun0.reqs) {
+        warn_noalloc();
+        return 0;
+    }
 
     int ret = scsi_rep_luns_scan(&vlun0.drive, virtio_scsi_add_lun);
-    return ret < 0 ? 0 : ret;
+    if (ret < 0) {
+        // Don't probe the luns of a target the host says isn't there
+        if (vlun0.reqs[0].resp.response == VIRTIO_SCSI_S_BAD_TARGET)
+            ret = 0;
+        else
+            ret = scsi_sequential_scan(&vlun0.drive, 8, virtio_scsi_add_lun);
+    }
+    free(vlun0.reqs);
+    return ret;
+}
+
+// Number of targets to probe, as advertised in the device config space
+static u32
+virtio_scsi_max_target(struct vp_device *vp)
+{
+    u16 max_target;
+    if (vp->use_modern || vp->use_mmio) {
+        max_target = vp_read(&vp->device, struct virtio_scsi_config,
+                             max_target);
+    } else {
+        struct virtio_scsi_config cfg;
+        vp_get_legacy(vp, 0, &cfg, sizeof(cfg));
+        max_target = cfg.max_target;
+    }
+    return max_target < 256 ? max_target + 1 : 256;
+}
+
+static int
+virtio_scsi_scan(struct pci_device *pci, void *mmio, struct vp_device *vp,
+                 struct vring_virtqueue *vq, int num)
+{
+    struct virtio_lun_s tmpl_vlun;
+    memset(&tmpl_vlun, 0, sizeof(tmpl_vlun));
+    tmpl_vlun.drive.cntl_id = pci ? pci->bdf : 0;
+    tmpl_vlun.pci = pci;
+    tmpl_vlun.mmio = mmio;
+    if (pci)
+        snprintf(tmpl_vlun.name, sizeof(tmpl_vlun.name), "pci:%pP", pci);
+    if (mmio)
+        snprintf(tmpl_vlun.name, sizeof(tmpl_vlun.name), "mmio:%08x",
+                 (u32)mmio);
+    tmpl_vlun.vp = vp;
+    tmpl_vlun.vq = vq;
+
+    /* Each request uses up to three descriptors (command, data and
+     * response), which bounds the requests in flight on the vring */
+    tmpl_vlun.nslots = num / 3 ?: 1;
+    tmpl_vlun.max_inflight = tmpl_vlun.nslots < VIRTIO_SCSI_MAX_INFLIGHT
+                             ? tmpl_vlun.nslots : VIRTIO_SCSI_MAX_INFLIGHT;
+    tmpl_vlun.slots = malloc_high(sizeof(*tmpl_vlun.slots)
+                                  * tmpl_vlun.nslots);
+    if (!tmpl_vlun.slots) {
+        warn_noalloc();
+        return 0;
+    }
+    memset(tmpl_vlun.slots, 0, sizeof(*tmpl_vlun.slots) * tmpl_vlun.nslots);
+
+    int tot = scsi_scan_targets(&tmpl_vlun, virtio_scsi_max_target(vp),
+                                VIRTIO_SCSI_SCAN_THREADS,
+                                virtio_scsi_scan_target);
+    if (!tot)
+        free(tmpl_vlun.slots);
+    return tot;
 }
 
 static void
@@ -189,12 +347,16 @@ init_virtio_scsi(void *data)
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
+        u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        vp_set_features(vp, features & (version1 | iommu_platform | packed
+                                        | event_idx | notify_data));
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
@@ -203,7 +365,8 @@ init_virtio_scsi(void *data)
         }
     }
 
-    if (vp_find_vq(vp, 2, &vq) < 0 ) {
+    int num = vp_find_vq(vp, 2, &vq);
+    if (num < 0) {
         dprintf(1, "fail to find vq for virtio-scsi %pP\n", pci);
         goto fail;
     }
@@ -211,11 +374,7 @@ init_virtio_scsi(void *data)
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
-    int i, tot;
-    for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(pci, NULL, vp, vq, i);
-
-    if (!tot)
+    if (!virtio_scsi_scan(pci, NULL, vp, vq, num))
         goto fail;
 
     return;
@@ -243,8 +402,12 @@ init_virtio_scsi_mmio(void *mmio)
     u64 version1 = 1ull << VIRTIO_F_VERSION_1;
     if (features & version1) {
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
+        u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        vp_set_features(vp, features & (version1 | iommu_platform | packed
+                                        | event_idx | notify_data));
         vp_set_status(vp, VIRTIO_CONFIG_S_FEATURES_OK);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
             dprintf(1, "device didn't accept features: %pP\n", mmio);
@@ -252,7 +415,8 @@ init_virtio_scsi_mmio(void *mmio)
         }
     }
 
-    if (vp_find_vq(vp, 2, &vq) < 0 ) {
+    int num = vp_find_vq(vp, 2, &vq);
+    if (num < 0) {
         dprintf(1, "fail to find vq for virtio-scsi-mmio %p\n", mmio);
         goto fail;
     }
@@ -260,11 +424,7 @@ init_virtio_scsi_mmio(void *mmio)
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
-    int i, tot;
-    for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(NULL, mmio, vp, vq, i);
-
-    if (!tot)
+    if (!virtio_scsi_scan(NULL, mmio, vp, vq, num))
         goto fail;
 
     return;
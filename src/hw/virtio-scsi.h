@@ -39,6 +39,8 @@ struct virtio_scsi_resp_cmd {
 } __attribute__((packed));
 
 #define VIRTIO_SCSI_S_OK            0
+#define VIRTIO_SCSI_S_BAD_TARGET    3
+#define VIRTIO_SCSI_S_FAILURE       9
 
 struct disk_op_s;
 int virtio_scsi_process_op(struct disk_op_s *op);
@@ -205,6 +205,11 @@ static inline void smp_rmb(void) {
 static inline void smp_wmb(void) {
     barrier();
 }
+/* Stores may be reordered after later loads, so a full barrier needs a
+ * locked instruction */
+static inline void smp_mb(void) {
+    asm volatile("lock; addl $0, 0(%%esp)" : : : "memory", "cc");
+}
 
 static inline void writel(void *addr, u32 val) {
     barrier();